@@ -0,0 +1,99 @@
+#include <stdlib.h>
+#include "arena.h"
+
+#ifdef __GNUC__
+#define ATOMIC_LOAD(x)			__atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(x, v)		__atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#define ATOMIC_FETCH_ADD(x, v)	__atomic_fetch_add(&(x), (v), __ATOMIC_ACQ_REL)
+#define SPIN_LOCK(x)			while(__atomic_exchange_n(&(x), 1, __ATOMIC_ACQUIRE))
+#define SPIN_UNLOCK(x)			__atomic_store_n(&(x), 0, __ATOMIC_RELEASE)
+#else
+/* no atomics, but without pthreads there aren't any concurrent builds either */
+#define ATOMIC_LOAD(x)			(x)
+#define ATOMIC_STORE(x, v)		((x) = (v))
+#define ATOMIC_FETCH_ADD(x, v)	(((x) += (v)) - (v))
+#define SPIN_LOCK(x)
+#define SPIN_UNLOCK(x)
+#endif
+
+#define ALIGN(x)	(((x) + 15) & ~(size_t)15)
+
+Arena::Arena(size_t block_size)
+{
+	blocks = 0;
+	this->block_size = block_size;
+	total_size = 0;
+	lock = 0;
+}
+
+Arena::~Arena()
+{
+	release();
+}
+
+void *Arena::alloc(size_t sz)
+{
+	sz = ALIGN(sz);
+
+	for(;;) {
+		Block *blk = ATOMIC_LOAD(blocks);
+
+		if(blk) {
+			size_t offs = ATOMIC_FETCH_ADD(blk->used, sz);
+			if(offs + sz <= blk->size) {
+				return (char*)(blk + 1) + offs;
+			}
+		}
+
+		/* the current block is full. Big allocations get a block of their own
+		 * behind the current one, so that its free space isn't wasted,
+		 * otherwise whoever gets the lock first starts a new block.
+		 */
+		bool big = sz > block_size / 4;
+		void *res = 0;
+
+		SPIN_LOCK(lock);
+		if(big || ATOMIC_LOAD(blocks) == blk) {
+			size_t bsz = big ? sz : block_size;
+			Block *nblk = (Block*)malloc(sizeof *nblk + bsz);
+
+			if(!nblk) {
+				SPIN_UNLOCK(lock);
+				return 0;
+			}
+			nblk->size = bsz;
+			nblk->used = big ? sz : 0;
+			total_size += bsz;
+
+			if(big && blk) {
+				nblk->next = blk->next;
+				blk->next = nblk;
+				res = nblk + 1;
+			} else {
+				nblk->next = blk;
+				ATOMIC_STORE(blocks, nblk);
+				if(big) res = nblk + 1;
+			}
+		}
+		SPIN_UNLOCK(lock);
+
+		if(res) {
+			return res;
+		}
+	}
+}
+
+void Arena::release()
+{
+	while(blocks) {
+		Block *blk = blocks;
+		blocks = blocks->next;
+		free(blk);
+	}
+	total_size = 0;
+}
+
+size_t Arena::get_size() const
+{
+	return total_size;
+}
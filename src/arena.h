@@ -0,0 +1,38 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>
+
+/* Bump allocator for data that is freed all at once (like the kd-tree).
+ * Allocations are carved sequentially out of big blocks, and nothing is freed
+ * until release() (or destruction) returns every block at once. alloc() is
+ * safe to call from multiple threads.
+ */
+class Arena {
+private:
+	struct Block {
+		Block *next;
+		size_t size, used;
+		size_t padding;		// keep the data following the header 16-byte aligned
+	};
+
+	Block *blocks;		// allocations are made from the first block
+	size_t block_size;
+	size_t total_size;
+	int lock;
+
+	Arena(const Arena&);
+	Arena &operator =(const Arena&);
+
+public:
+	Arena(size_t block_size = 256 * 1024);
+	~Arena();
+
+	void *alloc(size_t sz);
+	void release();
+
+	// total size of the blocks held by the arena
+	size_t get_size() const;
+};
+
+#endif	/* ARENA_H_ */
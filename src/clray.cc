@@ -3,6 +3,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
+#include <string>
 #ifndef __APPLE__
 #include <GL/glut.h>
 #else
@@ -38,6 +39,7 @@ static bool dbg_nocl;
 static bool dbg_show_kdtree;
 static bool dbg_show_obj = true;
 bool dbg_frame_time = true;
+static bool dbg_profile;
 
 static Scene scn;
 static unsigned int tex;
@@ -54,6 +56,13 @@ int main(int argc, char **argv)
 	glutInit(&argc, argv);
 
 	int loaded = 0;
+	const char *kdcache = 0;
+	const char *bincache = 0;
+	bool wavefront = false;
+	int batch_size = 0;
+	float vfov = 0.0;
+	std::string def_kdcache;
+
 	for(int i=1; i<argc; i++) {
 		if(argv[i][0] == '-' && argv[i][2] == 0) {
 			switch(argv[i][1]) {
@@ -84,6 +93,98 @@ int main(int argc, char **argv)
 				set_accel_param(ACCEL_PARAM_MAX_NODE_ITEMS, atoi(argv[i]));
 				break;
 
+			case 'b':
+				if(!argv[++i] || !isdigit(argv[i][0])) {
+					fprintf(stderr, "-b must be followed by the number of SAH bins per axis\n");
+					return 1;
+				}
+
+				set_accel_param(ACCEL_PARAM_BUILD_METHOD, KDBUILD_BINNED);
+				set_accel_param(ACCEL_PARAM_NUM_BINS, atoi(argv[i]));
+				break;
+
+			case 'p':
+				set_accel_param(ACCEL_PARAM_PERFECT_SPLITS, 1);
+				break;
+
+			case 'k':
+				// an empty filename disables the kd-tree cache
+				if(!argv[++i]) {
+					fprintf(stderr, "-k must be followed by the kd-tree cache filename\n");
+					return 1;
+				}
+				kdcache = argv[i];
+				break;
+
+			case 'x':
+				// an empty directory name disables the program binary cache
+				if(!argv[++i]) {
+					fprintf(stderr, "-x must be followed by the program cache directory\n");
+					return 1;
+				}
+				bincache = argv[i];
+				break;
+
+			case 'w':
+				wavefront = true;
+				break;
+
+			case 'q':
+				if(!argv[++i] || !isdigit(argv[i][0])) {
+					fprintf(stderr, "-q must be followed by the number of pixels per work-item in a batch\n");
+					return 1;
+				}
+				batch_size = atoi(argv[i]);
+				break;
+
+			case 'f':
+				if(!argv[++i] || !isdigit(argv[i][0])) {
+					fprintf(stderr, "-f must be followed by the vertical field of view in degrees\n");
+					return 1;
+				}
+				vfov = atof(argv[i]);
+				break;
+
+			case 'm':
+				if(!argv[++i] || (strcmp(argv[i], "image") != 0 && strcmp(argv[i], "buffer") != 0)) {
+					fprintf(stderr, "-m must be followed by the kd-tree storage: image or buffer\n");
+					return 1;
+				}
+				set_render_option(ROPT_KDTREE_BUFFER, strcmp(argv[i], "buffer") == 0);
+				break;
+
+			case 'r':
+				set_render_option(ROPT_KDTREE_ROPES, true);
+				break;
+
+			case 'g':
+				set_render_option(ROPT_SPECIALIZE, false);
+				break;
+
+			case 'u':
+				set_render_option(ROPT_TUNE_TILES, false);
+				break;
+
+			case 'a':
+				set_render_option(ROPT_PIPELINE, true);
+				break;
+
+			case 's':
+				set_multi_device(true);
+				break;
+
+			case 'o':
+				set_render_option(ROPT_SCENE_ARENA, true);
+				break;
+
+			case 'e':
+				set_device_benchmark(true);
+				break;
+
+			case 'v':
+				dbg_profile = true;
+				break;
+
 			case 'd':
 				dbg_glrender = true;
 				break;
@@ -101,7 +202,9 @@ int main(int argc, char **argv)
 				fprintf(stderr, "failed to load scene: %s\n", argv[i]);
 				return false;
 			}
-			loaded++;
+			if(!loaded++) {
+				def_kdcache = std::string(argv[i]) + ".kdtree";
+			}
 		}
 	}
 
@@ -113,6 +216,7 @@ int main(int argc, char **argv)
 		fprintf(stderr, "didn't load any polygons\n");
 		return false;
 	}
+	scn.set_kdtree_cache(kdcache ? kdcache : def_kdcache.c_str());
 
 	int num_lights = sizeof lightlist / sizeof *lightlist;
 	for(int i=0; i<num_lights; i++) {
@@ -147,6 +251,14 @@ int main(int argc, char **argv)
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F_ARB, xsz, ysz, 0, GL_RGBA, GL_UNSIGNED_BYTE, test_pattern);
 	delete [] test_pattern;
 
+	if(bincache) {
+		set_program_cache_dir(bincache);
+	} else {
+		const char *home = getenv("HOME");
+		std::string dir = home ? std::string(home) + "/.clray_cache" : ".clray_cache";
+		set_program_cache_dir(dir.c_str());
+	}
+
 	if(!init_opencl()) {
 		return 1;
 	}
@@ -154,6 +266,14 @@ int main(int argc, char **argv)
 	if(!init_renderer(xsz, ysz, &scn, tex)) {
 		return 1;
 	}
+	set_render_option(ROPT_WAVEFRONT, wavefront);
+	if(vfov > 0.0) {
+		set_render_option(ROPT_FOV, vfov);
+	}
+	if(batch_size > 0) {
+		set_render_option(ROPT_PERSISTENT, true);
+		set_render_option(ROPT_BATCH_SIZE, batch_size);
+	}
 	atexit(cleanup);
 
 	glutMainLoop();
@@ -203,14 +323,30 @@ void disp()
 				if(!render()) {
 					exit(1);
 				}
+				// come back to show this frame, if nothing else comes after it
+				if(get_render_option_bool(ROPT_PIPELINE)) {
+					glutPostRedisplay();
+				}
 
 				if(dbg_frame_time) {
 					const RenderStats *rstat = get_render_stats();
-					printf("render time (msec): %lu\n", rstat->render_time);
+					printf("render time (msec): %lu", rstat->render_time);
+					if(rstat->num_commands) {
+						printf(", device: %.2f (kernels %.2f, transfers %.2f, gl %.2f)", rstat->device_time,
+								rstat->kernel_time, rstat->transfer_time, rstat->gl_sync_time);
+					}
+					putchar('\n');
+				}
+				if(dbg_profile) {
+					print_frame_profile();
 				}
 			}
 			need_update = false;
 		}
+	} else if(!dbg_glrender && !dbg_nocl) {
+		if(!finish_render()) {
+			exit(1);
+		}
 	}
 
 	if(dbg_glrender) {
@@ -238,9 +374,15 @@ void disp()
 	glutSwapBuffers();
 
 	/* We need to make sure OpenGL has finished with the texture
-	 * before allowing the OpenCL kernel to run again.
+	 * before allowing the OpenCL kernel to run again. In pipelined mode
+	 * the next frame goes to the other texture, and render waits for
+	 * this one only before it has to reuse it.
 	 */
-	glFinish();
+	if(get_render_option_bool(ROPT_PIPELINE)) {
+		glFlush();
+	} else {
+		glFinish();
+	}
 }
 
 void reshape(int x, int y)
@@ -340,6 +482,26 @@ void keyb(unsigned char key, int x, int y)
 		}
 		break;
 
+	case 'w':
+		{
+			bool wf = !get_render_option_bool(ROPT_WAVEFRONT);
+			printf("switching to the %s kernel%s\n", wf ? "wavefront" : "single", wf ? "s" : "");
+			set_render_option(ROPT_WAVEFRONT, wf);
+			need_update = true;
+			glutPostRedisplay();
+		}
+		break;
+
+	case 'p':
+		{
+			bool pers = !get_render_option_bool(ROPT_PERSISTENT);
+			printf("%s persistent threads\n", pers ? "enabling" : "disabling");
+			set_render_option(ROPT_PERSISTENT, pers);
+			need_update = true;
+			glutPostRedisplay();
+		}
+		break;
+
 	case '`':
 		capture("shot%03d.ppm");
 		break;
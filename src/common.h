@@ -10,16 +10,18 @@
 /* primary ray magnitude */
 #define RAY_MAG		500.0
 
-/* maximum faces per leaf node of the kd-tree */
+/* default maximum faces per leaf node of the kd-tree (leaves may exceed it
+ * at the depth limit)
+ */
 #define MAX_NODE_FACES		32
 
 /* maximum kdtree depth */
 #define MAX_TREE_DEPTH		64
 
-/* width in pixels of the image-ified kdtree node */
-#define KDIMG_NODE_WIDTH	16
+/* low bits of KDNodeGPU::info for leaf nodes, otherwise they hold the split axis */
+#define KDNODE_LEAF		3
 
-/* maximum kdtree image height */
-#define KDIMG_MAX_HEIGHT	4096
+/* maximum kdtree image width, each pixel holds two nodes */
+#define KDIMG_MAX_WIDTH		4096
 
 #endif	/* COMMON_H_ */
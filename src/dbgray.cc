@@ -15,9 +15,9 @@ struct SurfPoint {
 static void trace_ray(float *pixel, const Ray &ray, int iter, float energy = 1.0f);
 static void shade(float *pixel, const Ray &ray, const SurfPoint &sp, int iter, float energy = 1.0f);
 static bool find_intersection(const Ray &ray, const Scene *scn, const KDNode *kd, SurfPoint *spret);
+static bool find_occlusion(const Ray &ray, const Scene *scn, const KDNode *kd);
 static bool ray_aabb_test(const Ray &ray, const AABBox &aabb);
-static bool ray_triangle_test(const Ray &ray, const Face *face, SurfPoint *sp);
-static Vector3 calc_bary(const Vector3 &pt, const Face *face, const Vector3 &norm);
+static bool ray_triangle_test(const Ray &ray, const TriAccel *tri, const Face *face, SurfPoint *sp);
 static void transform(float *res, const float *v, const float *xform);
 static void transform_ray(Ray *ray, const float *xform, const float *invtrans_xform);
 
@@ -25,7 +25,7 @@ static int xsz, ysz;
 static float *fb;
 static unsigned int tex;
 static Scene *scn;
-static const Ray *prim_rays;
+static float vfov;
 static int max_iter;
 
 static RenderStats *rstat;
@@ -53,12 +53,6 @@ bool init_dbg_renderer(int width, int height, Scene *scene, unsigned int texid)
 void destroy_dbg_renderer()
 {
 	delete [] fb;
-	delete [] prim_rays;
-}
-
-void dbg_set_primary_rays(const Ray *rays)
-{
-	prim_rays = rays;
 }
 
 void dbg_render(const float *xform, const float *invtrans_xform, int num_threads)
@@ -66,6 +60,7 @@ void dbg_render(const float *xform, const float *invtrans_xform, int num_threads
 	unsigned long t0 = get_msec();
 
 	max_iter = get_render_option_int(ROPT_ITER);
+	vfov = get_render_option_float(ROPT_FOV);
 
 	// initialize render-stats
 	memset(rstat, 0, sizeof *rstat);
@@ -75,7 +70,7 @@ void dbg_render(const float *xform, const float *invtrans_xform, int num_threads
 	int offs = 0;
 	for(int i=0; i<ysz; i++) {
 		for(int j=0; j<xsz; j++) {
-			Ray ray = prim_rays[offs];
+			Ray ray = get_primary_ray(j, i, xsz, ysz, vfov);
 			transform_ray(&ray, xform, invtrans_xform);
 
 			cur_ray_aabb_tests = cur_ray_triangle_tests = 0;
@@ -159,7 +154,7 @@ static void shade(float *pixel, const Ray &ray, const SurfPoint &sp, int iter, f
 		shadowray.dir[1] = ldir.y;
 		shadowray.dir[2] = ldir.z;
 
-		if(!cast_shadows || !find_intersection(shadowray, scn, scn->kdtree, 0)) {
+		if(!cast_shadows || !find_occlusion(shadowray, scn, scn->kdtree)) {
 			rstat->brdf_evals++;
 
 			ldir.normalize();
@@ -246,15 +241,40 @@ static bool find_intersection(const Ray &ray, const Scene *scn, const KDNode *kd
 	}
 
 	const Face *faces = scn->get_face_buffer();
+	const TriAccel *tris = scn->get_tri_accel_buffer();
 
-	for(size_t i=0; i<kd->face_idx.size(); i++) {
-		if(ray_triangle_test(ray, faces + kd->face_idx[i], &sp) && sp.t < spret->t) {
+	for(int i=0; i<kd->num_faces; i++) {
+		if(ray_triangle_test(ray, tris + kd->face_idx[i], faces + kd->face_idx[i], &sp) && sp.t < spret->t) {
 			*spret = sp;
 		}
 	}
 	return spret->face != 0;
 }
 
+// any-hit query for shadow rays, stops at the first face blocking the ray
+static bool find_occlusion(const Ray &ray, const Scene *scn, const KDNode *kd)
+{
+	if(!ray_aabb_test(ray, kd->aabb)) {
+		return false;
+	}
+
+	if(kd->left) {
+		assert(kd->right);
+		return find_occlusion(ray, scn, kd->left) || find_occlusion(ray, scn, kd->right);
+	}
+
+	const Face *faces = scn->get_face_buffer();
+	const TriAccel *tris = scn->get_tri_accel_buffer();
+
+	for(int i=0; i<kd->num_faces; i++) {
+		SurfPoint sp;
+		if(ray_triangle_test(ray, tris + kd->face_idx[i], faces + kd->face_idx[i], &sp)) {
+			return true;
+		}
+	}
+	return false;
+}
+
 static bool ray_aabb_test(const Ray &ray, const AABBox &aabb)
 {
 	cur_ray_aabb_tests++;
@@ -299,36 +319,37 @@ static bool ray_aabb_test(const Ray &ray, const AABBox &aabb)
 
 }
 
-static bool ray_triangle_test(const Ray &ray, const Face *face, SurfPoint *sp)
+// Moller-Trumbore test against the precomputed edges of the face, same as intersect() in rt.cl
+static bool ray_triangle_test(const Ray &ray, const TriAccel *tri, const Face *face, SurfPoint *sp)
 {
 	cur_ray_triangle_tests++;
 
 	Vector3 origin = ray.origin;
 	Vector3 dir = ray.dir;
-	Vector3 norm = face->normal;
-
-	float ndotdir = dot(dir, norm);
+	Vector3 e1 = tri->e1;
+	Vector3 e2 = tri->e2;
 
-	if(fabs(ndotdir) <= EPSILON) {
+	Vector3 pvec = cross(dir, e2);
+	float det = dot(e1, pvec);
+	if(det == 0.0) {
 		return false;
 	}
+	float inv_det = 1.0 / det;
 
-	Vector3 pt = face->v[0].pos;
-	Vector3 vec = pt - origin;
-
-	float ndotvec = dot(norm, vec);
-	float t = ndotvec / ndotdir;
-
-	if(t < EPSILON || t > 1.0) {
+	Vector3 tvec = origin - Vector3(tri->v0);
+	float u = dot(tvec, pvec) * inv_det;
+	if(u < 0.0 || u > 1.0) {
 		return false;
 	}
-	pt = origin + dir * t;
 
+	Vector3 qvec = cross(tvec, e1);
+	float v = dot(dir, qvec) * inv_det;
+	if(v < 0.0 || u + v > 1.0) {
+		return false;
+	}
 
-	Vector3 bc = calc_bary(pt, face, norm);
-	float bc_sum = bc.x + bc.y + bc.z;
-
-	if(bc_sum < 1.0 - EPSILON || bc_sum > 1.0 + EPSILON) {
+	float t = dot(e2, qvec) * inv_det;
+	if(t < EPSILON || t > 1.0) {
 		return false;
 	}
 
@@ -337,46 +358,13 @@ static bool ray_triangle_test(const Ray &ray, const Face *face, SurfPoint *sp)
 	Vector3 n2(face->v[2].normal);
 
 	sp->t = t;
-	sp->pos = pt;
-	sp->norm = n0 * bc.x + n1 * bc.y + n2 * bc.z;
+	sp->pos = origin + dir * t;
+	sp->norm = n0 * (1.0 - u - v) + n1 * u + n2 * v;
 	sp->norm.normalize();
 	sp->face = face;
 	return true;
 }
 
-static Vector3 calc_bary(const Vector3 &pt, const Face *face, const Vector3 &norm)
-{
-	Vector3 bc(0.0f, 0.0f, 0.0f);
-
-	Vector3 v1 = Vector3(face->v[1].pos) - Vector3(face->v[0].pos);
-	Vector3 v2 = Vector3(face->v[2].pos) - Vector3(face->v[0].pos);
-	Vector3 xv1v2 = cross(v1, v2);
-
-	float area = fabs(dot(xv1v2, norm)) * 0.5;
-	if(area < EPSILON) {
-		return bc;
-	}
-
-	Vector3 pv0 = face->v[0].pos - pt;
-	Vector3 pv1 = face->v[1].pos - pt;
-	Vector3 pv2 = face->v[2].pos - pt;
-
-	// calculate the area of each sub-triangle
-	Vector3 x12 = cross(pv1, pv2);
-	Vector3 x20 = cross(pv2, pv0);
-	Vector3 x01 = cross(pv0, pv1);
-
-	float a0 = fabs(dot(x12, norm)) * 0.5;
-	float a1 = fabs(dot(x20, norm)) * 0.5;
-	float a2 = fabs(dot(x01, norm)) * 0.5;
-
-	bc.x = a0 / area;
-	bc.y = a1 / area;
-	bc.z = a2 / area;
-	return bc;
-
-}
-
 static void transform(float *res, const float *v, const float *xform)
 {
 	float tmp[3];
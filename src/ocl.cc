@@ -8,15 +8,23 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <assert.h>
+#include <limits.h>
+#include <map>
 #ifndef _MSC_VER
 #include <alloca.h>
 #else
 #include <malloc.h>
 #endif
 #include <sys/stat.h>
+#ifndef _MSC_VER
+#include <sys/types.h>
+#else
+#include <direct.h>
+#endif
 #include "ocl.h"
 #include "ogl.h"
 #include "ocl_errstr.h"
+#include "timer.h"
 
 #if defined(unix) || defined(__unix__)
 #include <X11/Xlib.h>
@@ -40,6 +48,9 @@ struct device_info {
 
 	unsigned long mem_size;
 
+	cl_bool image_support;
+	size_t image2d_max_size[2];
+
 	char *extensions;
 	bool gl_sharing;
 };
@@ -52,14 +63,74 @@ static const char *devtypestr(cl_device_type type);
 static void print_memsize(FILE *out, unsigned long memsz);
 static const char *clstrerror(int err);
 
+static bool read_source(const char *fname, std::string *dest, int depth);
+static std::string cache_key(const char *opt);
+static std::string get_dev_string(cl_device_id dev, cl_device_info what);
+static cl_program load_cached_binary(const std::string &key, const std::string &src, const char *opt);
+static void save_cached_binary(cl_program prog, const std::string &key, const std::string &src);
+static void make_cache_dir();
+static int get_extra_devices(cl_device_id *dev, int max_dev);
+static CLMemBuffer *get_band_image(int dev, int xsz, int ysz);
+static void prof_record(int type, const char *name, cl_event pev, cl_event *ev);
+static int select_device_bench(struct device_info *di);
+static double bench_device(cl_platform_id plat, cl_device_id dev);
+static std::string dev_key(cl_device_id dev);
+static size_t pool_class_size(size_t sz);
+static CLMemBuffer *new_mem_buffer(int type, cl_mem mem, size_t sz);
+
 
 static cl_context ctx;
 static cl_command_queue cmdq;
 static device_info devinf;
 
+/* with multi-device enabled, the rest of the devices of the platform are added
+ * to the context, each with its own queue. Index 0 is always devinf/cmdq.
+ */
+static bool multi_device;
+static bool bench_select;
+static cl_device_id devices[MAX_DEVICES];
+static cl_command_queue queues[MAX_DEVICES];
+static int num_devices;
+
+/* events of the commands queued since the last get_profile, the oldest ones
+ * are dropped if nobody asks for them.
+ */
+#define MAX_PROF_EVENTS		4096
+
+struct ProfEvent {
+	int type;
+	std::string name;
+	cl_event ev;
+};
+static std::vector<ProfEvent> prof_events;
+
+// images the other devices render their part of the frame to, see run_bands
+static CLMemBuffer *band_img[MAX_DEVICES];
+static cl_event band_copy_ev[MAX_DEVICES];
+
+static std::string cache_dir;
+
+/* free lists of released buffers, by access flags and size class. Anything
+ * released over MAX_POOL_BYTES goes back to the driver.
+ */
+#define MIN_POOL_SIZE	256
+#define MAX_POOL_BYTES	(64 << 20)
+
+typedef std::pair<cl_mem_flags, size_t> PoolKey;
+static std::map<PoolKey, std::vector<cl_mem> > mem_pool;
+static size_t mem_pool_bytes;
+
+#ifndef MIN
+#define MIN(a, b)	((a) < (b) ? (a) : (b))
+#endif
+
 bool init_opencl()
 {
-	if(select_device(&devinf, devcmp) == -1) {
+	if(bench_select && select_device_bench(&devinf) == -1) {
+		fprintf(stderr, "device benchmark failed, picking the device by its specs\n");
+		bench_select = false;
+	}
+	if(!bench_select && select_device(&devinf, devcmp) == -1) {
 		return false;
 	}
 
@@ -106,24 +177,65 @@ bool init_opencl()
 
 #endif	/* CLGL_INTEROP */
 
-	if(!(ctx = clCreateContext(prop, 1, &devinf.id, 0, 0, 0))) {
+	devices[0] = devinf.id;
+	num_devices = 1;
+	if(multi_device) {
+		num_devices += get_extra_devices(devices + 1, MAX_DEVICES - 1);
+	}
+
+	if(num_devices > 1 && !(ctx = clCreateContext(prop, num_devices, devices, 0, 0, 0))) {
+		// most likely not all of them can share with OpenGL
+		fprintf(stderr, "failed to create a context with %d devices, using only the first\n", num_devices);
+		num_devices = 1;
+	}
+	if(num_devices == 1 && !(ctx = clCreateContext(prop, 1, &devinf.id, 0, 0, 0))) {
 		fprintf(stderr, "failed to create opencl context\n");
 		return false;
 	}
 
-	if(!(cmdq = clCreateCommandQueue(ctx, devinf.id, 0, 0))) {
-		fprintf(stderr, "failed to create command queue\n");
-		return false;
+	/* every command's times are recorded (see get_profile), and the frame split
+	 * across devices is balanced with them as well
+	 */
+	cl_command_queue_properties qprop = CL_QUEUE_PROFILING_ENABLE;
+
+	for(int i=0; i<num_devices; i++) {
+		if(!(queues[i] = clCreateCommandQueue(ctx, devices[i], qprop, 0))) {
+			fprintf(stderr, "failed to create command queue\n");
+			return false;
+		}
 	}
+	cmdq = queues[0];
 	return true;
 }
 
 void destroy_opencl()
 {
-	if(cmdq) {
-		clReleaseCommandQueue(cmdq);
-		cmdq = 0;
+	release_mem_pool();
+
+	for(size_t i=0; i<prof_events.size(); i++) {
+		clReleaseEvent(prof_events[i].ev);
+	}
+	prof_events.clear();
+
+	for(int i=0; i<num_devices; i++) {
+		if(band_copy_ev[i]) {
+			clReleaseEvent(band_copy_ev[i]);
+			band_copy_ev[i] = 0;
+		}
+		if(band_img[i]) {
+			destroy_mem_buffer(band_img[i]);
+			band_img[i] = 0;
+		}
+	}
+
+	for(int i=0; i<num_devices; i++) {
+		if(queues[i]) {
+			clReleaseCommandQueue(queues[i]);
+			queues[i] = 0;
+		}
 	}
+	cmdq = 0;
+	num_devices = 0;
 
 	if(ctx) {
 		clReleaseContext(ctx);
@@ -136,34 +248,232 @@ void finish_opencl()
 	clFinish(cmdq);
 }
 
+void flush_opencl()
+{
+	clFlush(cmdq);
+}
+
+int get_profile(std::vector<ProfRecord> *recs, bool wait)
+{
+	std::vector<ProfEvent> pending;
+	size_t first = recs->size();
+
+	for(size_t i=0; i<prof_events.size(); i++) {
+		ProfEvent *pe = &prof_events[i];
+		cl_int status;
+
+		if(wait) {
+			clWaitForEvents(1, &pe->ev);
+		} else if(clGetEventInfo(pe->ev, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof status, &status, 0) != 0 ||
+				status > CL_COMPLETE) {
+			pending.push_back(*pe);
+			continue;
+		}
+
+		cl_ulong t[4];
+		static const cl_profiling_info what[] = {
+			CL_PROFILING_COMMAND_QUEUED, CL_PROFILING_COMMAND_SUBMIT,
+			CL_PROFILING_COMMAND_START, CL_PROFILING_COMMAND_END
+		};
+		bool valid = true;
+		for(int j=0; j<4; j++) {
+			if(clGetEventProfilingInfo(pe->ev, what[j], sizeof t[j], t + j, 0) != 0) {
+				valid = false;	// failed commands and GL commands on some drivers
+				break;
+			}
+		}
+		clReleaseEvent(pe->ev);
+
+		if(valid) {
+			ProfRecord rec;
+			rec.type = pe->type;
+			rec.name = pe->name;
+			rec.queued = t[0] / 1000000.0;
+			rec.submit = t[1] / 1000000.0;
+			rec.start = t[2] / 1000000.0;
+			rec.end = t[3] / 1000000.0;
+			recs->push_back(rec);
+		}
+	}
+	prof_events.swap(pending);
+
+	if(recs->size() == first) {
+		return 0;
+	}
+
+	// make the times relative to the first command queued
+	double t0 = (*recs)[first].queued;
+	for(size_t i=first + 1; i<recs->size(); i++) {
+		t0 = MIN(t0, (*recs)[i].queued);
+	}
+	for(size_t i=first; i<recs->size(); i++) {
+		ProfRecord *rec = &(*recs)[i];
+		rec->queued -= t0;
+		rec->submit -= t0;
+		rec->start -= t0;
+		rec->end -= t0;
+	}
+	return (int)(recs->size() - first);
+}
+
+/* keeps the event of a command for the profile, and also passes it on if the
+ * caller wants it (with its own reference).
+ */
+static void prof_record(int type, const char *name, cl_event pev, cl_event *ev)
+{
+	if(ev) {
+		*ev = pev;
+		clRetainEvent(pev);
+	}
+
+	if(prof_events.size() >= MAX_PROF_EVENTS) {
+		clReleaseEvent(prof_events[0].ev);
+		prof_events.erase(prof_events.begin());
+	}
+
+	ProfEvent pe;
+	pe.type = type;
+	pe.name = name;
+	pe.ev = pev;
+	prof_events.push_back(pe);
+}
+
+void set_multi_device(bool enable)
+{
+	multi_device = enable;
+}
+
+void set_device_benchmark(bool enable)
+{
+	bench_select = enable;
+}
+
+int get_num_devices()
+{
+	return num_devices;
+}
+
+int get_num_compute_units()
+{
+	return (int)devinf.units;
+}
+
+void set_program_cache_dir(const char *dir)
+{
+	cache_dir = dir ? dir : "";
+}
+
+bool get_image2d_max_size(size_t *xsz, size_t *ysz)
+{
+	if(!devinf.image_support) {
+		return false;
+	}
+	*xsz = devinf.image2d_max_size[0];
+	*ysz = devinf.image2d_max_size[1];
+	return true;
+}
+
 
 CLMemBuffer *create_mem_buffer(int rdwr, size_t sz, const void *buf)
 {
 	int err;
-	cl_mem mem;
+	cl_mem mem = 0;
 	cl_mem_flags flags = rdwr | CL_MEM_ALLOC_HOST_PTR;
+	size_t csz = pool_class_size(sz);
 
-	if(buf) {
-		flags |= CL_MEM_COPY_HOST_PTR;
+	std::map<PoolKey, std::vector<cl_mem> >::iterator it = mem_pool.find(PoolKey(flags, csz));
+	if(it != mem_pool.end() && !it->second.empty()) {
+		mem = it->second.back();
+		it->second.pop_back();
+		mem_pool_bytes -= csz;
 	}
 
-
-	if(!(mem = clCreateBuffer(ctx, flags, sz, (void*)buf, &err))) {
+	if(!mem && !(mem = clCreateBuffer(ctx, flags, csz, 0, &err))) {
 		fprintf(stderr, "failed to create memory buffer: %s\n", clstrerror(err));
 		return 0;
 	}
 
-	CLMemBuffer *mbuf = new CLMemBuffer;
-	mbuf->type = MEM_BUFFER;
-	mbuf->mem = mem;
-	mbuf->size = sz;
-	mbuf->xsz = mbuf->ysz = 0;
-	mbuf->ptr = 0;
-	mbuf->tex = 0;
+	CLMemBuffer *mbuf = new_mem_buffer(MEM_BUFFER, mem, sz);
+	mbuf->pool_size = csz;
+
+	if(buf && !write_mem_buffer(mbuf, sz, buf)) {
+		destroy_mem_buffer(mbuf);
+		return 0;
+	}
 	return mbuf;
 }
 
-CLMemBuffer *create_image_buffer(int rdwr, int xsz, int ysz, const void *pixels)
+void release_mem_pool()
+{
+	std::map<PoolKey, std::vector<cl_mem> >::iterator it = mem_pool.begin();
+	while(it != mem_pool.end()) {
+		for(size_t i=0; i<it->second.size(); i++) {
+			clReleaseMemObject(it->second[i]);
+		}
+		++it;
+	}
+	mem_pool.clear();
+	mem_pool_bytes = 0;
+}
+
+CLMemBuffer *create_mem_arena(int rdwr, int num, const size_t *sizes, const void * const *data, CLMemBuffer **parts)
+{
+	// sub-buffers have to start at a multiple of the largest base alignment
+	size_t align = 128;
+	for(int i=0; i<num_devices; i++) {
+		cl_uint bits;
+		if(clGetDeviceInfo(devices[i], CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof bits, &bits, 0) == 0 && bits / 8 > align) {
+			align = bits / 8;
+		}
+	}
+
+	size_t *offs = (size_t*)alloca(num * sizeof *offs);
+	size_t total = 0;
+	for(int i=0; i<num; i++) {
+		if(!sizes[i]) {
+			fprintf(stderr, "invalid size for arena part %d: 0 bytes\n", i);
+			return 0;
+		}
+		offs[i] = total;
+		total += (sizes[i] + align - 1) & ~(align - 1);
+	}
+
+	int err;
+	cl_mem mem;
+	if(!(mem = clCreateBuffer(ctx, rdwr | CL_MEM_ALLOC_HOST_PTR, total, 0, &err))) {
+		fprintf(stderr, "failed to create %lu byte arena buffer: %s\n", (unsigned long)total, clstrerror(err));
+		return 0;
+	}
+	CLMemBuffer *arena = new_mem_buffer(MEM_BUFFER, mem, total);
+
+	for(int i=0; i<num; i++) {
+		parts[i] = 0;
+	}
+
+	for(int i=0; i<num; i++) {
+		cl_buffer_region rgn = {offs[i], sizes[i]};
+		if(!(mem = clCreateSubBuffer(arena->mem, rdwr, CL_BUFFER_CREATE_TYPE_REGION, &rgn, &err))) {
+			fprintf(stderr, "failed to create sub-buffer %d of the arena: %s\n", i, clstrerror(err));
+			goto err;
+		}
+		parts[i] = new_mem_buffer(MEM_BUFFER, mem, sizes[i]);
+
+		if(data[i] && !write_mem_buffer(parts[i], sizes[i], data[i])) {
+			goto err;
+		}
+	}
+	return arena;
+
+err:
+	for(int i=0; i<num; i++) {
+		destroy_mem_buffer(parts[i]);
+		parts[i] = 0;
+	}
+	destroy_mem_buffer(arena);
+	return 0;
+}
+
+CLMemBuffer *create_image_buffer(int rdwr, int xsz, int ysz, const void *pixels, int chan_type)
 {
 	int err, pitch;
 	cl_mem mem;
@@ -176,21 +486,17 @@ CLMemBuffer *create_image_buffer(int rdwr, int xsz, int ysz, const void *pixels)
 		pitch = 0;
 	}
 
-	cl_image_format fmt = {CL_RGBA, CL_FLOAT};
+	// both channel types are 32bit, so the pitch is the same
+	cl_image_format fmt = {CL_RGBA, (cl_channel_type)chan_type};
 
 	if(!(mem = clCreateImage2D(ctx, flags, &fmt, xsz, ysz, pitch, (void*)pixels, &err))) {
 		fprintf(stderr, "failed to create %dx%d image: %s\n", xsz, ysz, clstrerror(err));
 		return 0;
 	}
 
-	CLMemBuffer *mbuf = new CLMemBuffer;
-	mbuf->type = IMAGE_BUFFER;
-	mbuf->mem = mem;
-	mbuf->size = ysz * pitch;
+	CLMemBuffer *mbuf = new_mem_buffer(IMAGE_BUFFER, mem, ysz * pitch);
 	mbuf->xsz = xsz;
 	mbuf->ysz = ysz;
-	mbuf->ptr = 0;
-	mbuf->tex = 0;
 	return mbuf;
 }
 
@@ -217,13 +523,9 @@ CLMemBuffer *create_image_buffer(int rdwr, unsigned int tex)
 		return 0;
 	}
 
-	CLMemBuffer *mbuf = new CLMemBuffer;
-	mbuf->type = IMAGE_BUFFER;
-	mbuf->mem = mem;
-	mbuf->size = 0;
+	CLMemBuffer *mbuf = new_mem_buffer(IMAGE_BUFFER, mem, 0);
 	mbuf->xsz = xsz;
 	mbuf->ysz = ysz;
-	mbuf->ptr = 0;
 	mbuf->tex = tex;
 
 	return mbuf;
@@ -231,10 +533,19 @@ CLMemBuffer *create_image_buffer(int rdwr, unsigned int tex)
 
 void destroy_mem_buffer(CLMemBuffer *mbuf)
 {
-	if(mbuf) {
-		clReleaseMemObject(mbuf->mem);
-		delete mbuf;
+	if(!mbuf) return;
+
+	if(mbuf->pool_size && mem_pool_bytes + mbuf->pool_size <= MAX_POOL_BYTES) {
+		cl_mem_flags flags;
+		if(clGetMemObjectInfo(mbuf->mem, CL_MEM_FLAGS, sizeof flags, &flags, 0) == 0) {
+			mem_pool[PoolKey(flags, mbuf->pool_size)].push_back(mbuf->mem);
+			mem_pool_bytes += mbuf->pool_size;
+			delete mbuf;
+			return;
+		}
 	}
+	clReleaseMemObject(mbuf->mem);
+	delete mbuf;
 }
 
 void *map_mem_buffer(CLMemBuffer *mbuf, int rdwr, cl_event *ev)
@@ -248,9 +559,10 @@ void *map_mem_buffer(CLMemBuffer *mbuf, int rdwr, cl_event *ev)
 #endif
 
 	int err;
+	cl_event pev;
 
 	if(mbuf->type == MEM_BUFFER) {
-		mbuf->ptr = clEnqueueMapBuffer(cmdq, mbuf->mem, 1, rdwr, 0, mbuf->size, 0, 0, ev, &err);
+		mbuf->ptr = clEnqueueMapBuffer(cmdq, mbuf->mem, 1, rdwr, 0, mbuf->size, 0, 0, &pev, &err);
 		if(!mbuf->ptr) {
 			fprintf(stderr, "failed to map buffer: %s\n", clstrerror(err));
 			return 0;
@@ -262,7 +574,7 @@ void *map_mem_buffer(CLMemBuffer *mbuf, int rdwr, cl_event *ev)
 		size_t rgn[] = {mbuf->xsz, mbuf->ysz, 1};
 		size_t pitch;
 
-		mbuf->ptr = clEnqueueMapImage(cmdq, mbuf->mem, 1, rdwr, orig, rgn, &pitch, 0, 0, 0, ev, &err);
+		mbuf->ptr = clEnqueueMapImage(cmdq, mbuf->mem, 1, rdwr, orig, rgn, &pitch, 0, 0, 0, &pev, &err);
 		if(!mbuf->ptr) {
 			fprintf(stderr, "failed to map image: %s\n", clstrerror(err));
 			return 0;
@@ -270,6 +582,7 @@ void *map_mem_buffer(CLMemBuffer *mbuf, int rdwr, cl_event *ev)
 
 		assert(pitch == mbuf->xsz * 4 * sizeof(float));
 	}
+	prof_record(PROF_MAP, "map", pev, ev);
 	return mbuf->ptr;
 }
 
@@ -277,7 +590,10 @@ void unmap_mem_buffer(CLMemBuffer *mbuf, cl_event *ev)
 {
 	if(!mbuf || !mbuf->ptr) return;
 
-	clEnqueueUnmapMemObject(cmdq, mbuf->mem, mbuf->ptr, 0, 0, ev);
+	cl_event pev;
+	if(clEnqueueUnmapMemObject(cmdq, mbuf->mem, mbuf->ptr, 0, 0, &pev) == 0) {
+		prof_record(PROF_MAP, "unmap", pev, ev);
+	}
 	mbuf->ptr = 0;
 }
 
@@ -286,10 +602,26 @@ bool write_mem_buffer(CLMemBuffer *mbuf, size_t sz, const void *src, cl_event *e
 	if(!mbuf) return false;
 
 	int err;
-	if((err = clEnqueueWriteBuffer(cmdq, mbuf->mem, 1, 0, sz, src, 0, 0, ev)) != 0) {
+	cl_event pev;
+	if((err = clEnqueueWriteBuffer(cmdq, mbuf->mem, 1, 0, sz, src, 0, 0, &pev)) != 0) {
 		fprintf(stderr, "failed to write buffer: %s\n", clstrerror(err));
 		return false;
 	}
+	prof_record(PROF_WRITE, "write", pev, ev);
+	return true;
+}
+
+bool write_mem_buffer_async(CLMemBuffer *mbuf, size_t sz, const void *src, cl_event *ev)
+{
+	if(!mbuf) return false;
+
+	int err;
+	cl_event pev;
+	if((err = clEnqueueWriteBuffer(cmdq, mbuf->mem, 0, 0, sz, src, 0, 0, &pev)) != 0) {
+		fprintf(stderr, "failed to write buffer: %s\n", clstrerror(err));
+		return false;
+	}
+	prof_record(PROF_WRITE, "write", pev, ev);
 	return true;
 }
 
@@ -298,10 +630,12 @@ bool read_mem_buffer(CLMemBuffer *mbuf, size_t sz, void *dest, cl_event *ev)
 	if(!mbuf) return false;
 
 	int err;
-	if((err = clEnqueueReadBuffer(cmdq, mbuf->mem, 1, 0, sz, dest, 0, 0, ev)) != 0) {
+	cl_event pev;
+	if((err = clEnqueueReadBuffer(cmdq, mbuf->mem, 1, 0, sz, dest, 0, 0, &pev)) != 0) {
 		fprintf(stderr, "failed to read buffer: %s\n", clstrerror(err));
 		return false;
 	}
+	prof_record(PROF_READ, "read", pev, ev);
 	return true;
 }
 
@@ -313,10 +647,12 @@ bool acquire_gl_object(CLMemBuffer *mbuf, cl_event *ev)
 	}
 
 	int err;
-	if((err = clEnqueueAcquireGLObjects(cmdq, 1, &mbuf->mem, 0, 0, ev)) != 0) {
+	cl_event pev;
+	if((err = clEnqueueAcquireGLObjects(cmdq, 1, &mbuf->mem, 0, 0, &pev)) != 0) {
 		fprintf(stderr, "failed to acquire gl object: %s\n", clstrerror(err));
 		return false;
 	}
+	prof_record(PROF_GL, "gl acquire", pev, ev);
 	return true;
 }
 
@@ -327,10 +663,12 @@ bool release_gl_object(CLMemBuffer *mbuf, cl_event *ev)
 	}
 
 	int err;
-	if((err = clEnqueueReleaseGLObjects(cmdq, 1, &mbuf->mem, 0, 0, ev)) != 0) {
+	cl_event pev;
+	if((err = clEnqueueReleaseGLObjects(cmdq, 1, &mbuf->mem, 0, 0, &pev)) != 0) {
 		fprintf(stderr, "failed to release gl object: %s\n", clstrerror(err));
 		return false;
 	}
+	prof_record(PROF_GL, "gl release", pev, ev);
 	return true;
 }
 
@@ -354,6 +692,7 @@ CLProgram::CLProgram(const char *kname)
 
 CLProgram::~CLProgram()
 {
+	release_bands();
 	if(wait_event) {
 		clReleaseEvent(wait_event);
 	}
@@ -377,32 +716,20 @@ CLProgram::~CLProgram()
 
 bool CLProgram::load(const char *fname)
 {
-	FILE *fp;
-	char *src;
-	struct stat st;
-
 	printf("loading opencl program (%s)\n", fname);
 
-	if(!(fp = fopen(fname, "rb"))) {
-		fprintf(stderr, "failed to open %s: %s\n", fname, strerror(errno));
+	src.clear();
+	if(!read_source(fname, &src, 0)) {
 		return false;
 	}
+	src_name = fname;
+	return true;
+}
 
-	fstat(fileno(fp), &st);
-
-	src = new char[st.st_size + 1];
-
-	fread(src, 1, st.st_size, fp);
-	src[st.st_size] = 0;
-	fclose(fp);
-
-
-	if(!(prog = clCreateProgramWithSource(ctx, 1, (const char**)&src, 0, 0))) {
-		fprintf(stderr, "error creating program object: %s\n", fname);
-		delete [] src;
-		return false;
-	}
-	delete [] src;
+bool CLProgram::load_source(const char *src, const char *name)
+{
+	this->src = src;
+	src_name = name ? name : "<embedded>";
 	return true;
 }
 
@@ -415,7 +742,9 @@ bool CLProgram::set_argi(int idx, int val)
 	CLArg *arg = &args[idx];
 	arg->type = ARGTYPE_INT;
 	arg->v.ival = val;
-	return true;
+
+	// scalar arguments may change between runs
+	return built ? bind_arg(idx) : true;
 }
 
 bool CLProgram::set_argf(int idx, float val)
@@ -427,7 +756,8 @@ bool CLProgram::set_argf(int idx, float val)
 	CLArg *arg = &args[idx];
 	arg->type = ARGTYPE_FLOAT;
 	arg->v.fval = val;
-	return true;
+
+	return built ? bind_arg(idx) : true;
 }
 
 bool CLProgram::set_arg_buffer(int idx, int rdwr, size_t sz, const void *ptr)
@@ -451,12 +781,12 @@ bool CLProgram::set_arg_buffer(int idx, int rdwr, size_t sz, const void *ptr)
 	return true;
 }
 
-bool CLProgram::set_arg_image(int idx, int rdwr, int xsz, int ysz, const void *pix)
+bool CLProgram::set_arg_image(int idx, int rdwr, int xsz, int ysz, const void *pix, int chan_type)
 {
 	printf("create argument %d from %dx%d image\n", idx, xsz, ysz);
 	CLMemBuffer *buf;
 
-	if(!(buf = create_image_buffer(rdwr, xsz, ysz, pix))) {
+	if(!(buf = create_image_buffer(rdwr, xsz, ysz, pix, chan_type))) {
 		return false;
 	}
 
@@ -485,9 +815,29 @@ bool CLProgram::set_arg_texture(int idx, int rdwr, unsigned int tex)
 	return true;
 }
 
+bool CLProgram::set_arg_shared(int idx, CLMemBuffer *mbuf)
+{
+	if(!mbuf) {
+		fprintf(stderr, "invalid shared buffer for argument %d\n", idx);
+		return false;
+	}
+
+	if((int)args.size() <= idx) {
+		args.resize(idx + 1);
+	}
+	args[idx].type = ARGTYPE_MEM_REF;
+	args[idx].v.mbuf = mbuf;
+
+	// may be switched to another buffer between runs
+	return built ? bind_arg(idx) : true;
+}
+
 CLMemBuffer *CLProgram::get_arg_buffer(int arg)
 {
-	if(arg < 0 || arg >= (int)args.size() || args[arg].type != ARGTYPE_MEM_BUF) {
+	if(arg < 0 || arg >= (int)args.size()) {
+		return 0;
+	}
+	if(args[arg].type != ARGTYPE_MEM_BUF && args[arg].type != ARGTYPE_MEM_REF) {
 		return 0;
 	}
 	return args[arg].v.mbuf;
@@ -507,19 +857,44 @@ int CLProgram::get_num_args() const
 bool CLProgram::build(const char *opt)
 {
 	int err;
-	if((err = clBuildProgram(prog, 0, 0, opt, 0, 0)) != 0) {
-		size_t sz;
-		clGetProgramBuildInfo(prog, devinf.id, CL_PROGRAM_BUILD_LOG, 0, 0, &sz);
-
-		char *errlog = (char*)alloca(sz + 1);
-		clGetProgramBuildInfo(prog, devinf.id, CL_PROGRAM_BUILD_LOG, sz, errlog, 0);
-		fprintf(stderr, "failed to build program: %s\n%s\n", clstrerror(err), errlog);
 
-		clReleaseProgram(prog);
-		prog = 0;
+	if(src.empty()) {
+		fprintf(stderr, "can't build %s, no program source loaded\n", kname.c_str());
 		return false;
 	}
 
+	// the cache keeps a single binary, for the primary device
+	std::string key;
+	if(!cache_dir.empty() && num_devices == 1) {
+		key = cache_key(opt);
+		prog = load_cached_binary(key, src, opt);
+	}
+
+	if(!prog) {
+		const char *srcptr = src.c_str();
+		if(!(prog = clCreateProgramWithSource(ctx, 1, &srcptr, 0, 0))) {
+			fprintf(stderr, "error creating program object: %s\n", src_name.c_str());
+			return false;
+		}
+
+		if((err = clBuildProgram(prog, 0, 0, opt, 0, 0)) != 0) {
+			size_t sz;
+			clGetProgramBuildInfo(prog, devinf.id, CL_PROGRAM_BUILD_LOG, 0, 0, &sz);
+
+			char *errlog = (char*)alloca(sz + 1);
+			clGetProgramBuildInfo(prog, devinf.id, CL_PROGRAM_BUILD_LOG, sz, errlog, 0);
+			errlog[sz] = 0;
+			fprintf(stderr, "failed to build program: %s\n%s\n", clstrerror(err), errlog);
+
+			clReleaseProgram(prog);
+			prog = 0;
+			return false;
+		}
+
+		if(!key.empty()) {
+			save_cached_binary(prog, key, src);
+		}
+	}
 
 	if(!(kernel = clCreateKernel(prog, kname.c_str(), 0))) {
 		fprintf(stderr, "failed to create kernel: %s\n", kname.c_str());
@@ -529,40 +904,12 @@ bool CLProgram::build(const char *opt)
 	}
 
 	for(size_t i=0; i<args.size(); i++) {
-		int err;
-
 		if(args[i].type == ARGTYPE_NONE) {
 			break;
 		}
 
-		switch(args[i].type) {
-		case ARGTYPE_INT:
-			if((err = clSetKernelArg(kernel, i, sizeof(int), &args[i].v.ival)) != 0) {
-				fprintf(stderr, "failed to bind kernel argument %d: %s\n", (int)i, clstrerror(err));
-				goto fail;
-			}
-			break;
-
-		case ARGTYPE_FLOAT:
-			if((err = clSetKernelArg(kernel, i, sizeof(float), &args[i].v.fval)) != 0) {
-				fprintf(stderr, "failed to bind kernel argument %d: %s\n", (int)i, clstrerror(err));
-				goto fail;
-			}
-			break;
-
-		case ARGTYPE_MEM_BUF:
-			{
-				CLMemBuffer *mbuf = args[i].v.mbuf;
-
-				if((err = clSetKernelArg(kernel, i, sizeof mbuf->mem, &mbuf->mem)) != 0) {
-					fprintf(stderr, "failed to bind kernel argument %d: %s\n", (int)i, clstrerror(err));
-					goto fail;
-				}
-			}
-			break;
-
-		default:
-			break;
+		if(!bind_arg(i)) {
+			goto fail;
 		}
 	}
 
@@ -577,6 +924,38 @@ fail:
 	return false;
 }
 
+bool CLProgram::bind_arg(int idx)
+{
+	int err = 0;
+
+	switch(args[idx].type) {
+	case ARGTYPE_INT:
+		err = clSetKernelArg(kernel, idx, sizeof(int), &args[idx].v.ival);
+		break;
+
+	case ARGTYPE_FLOAT:
+		err = clSetKernelArg(kernel, idx, sizeof(float), &args[idx].v.fval);
+		break;
+
+	case ARGTYPE_MEM_BUF:
+	case ARGTYPE_MEM_REF:
+		{
+			CLMemBuffer *mbuf = args[idx].v.mbuf;
+			err = clSetKernelArg(kernel, idx, sizeof mbuf->mem, &mbuf->mem);
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	if(err != 0) {
+		fprintf(stderr, "failed to bind kernel argument %d: %s\n", idx, clstrerror(err));
+		return false;
+	}
+	return true;
+}
+
 bool CLProgram::run() const
 {
 	return run(1, 1);
@@ -593,21 +972,299 @@ bool CLProgram::run(int dim, ...) const
 	}
 	va_end(ap);
 
+	return run_ndrange(dim, global_size);
+}
+
+bool CLProgram::run_ndrange(int dim, const size_t *global_size, const size_t *local_size) const
+{
 	if(last_event) {
 		clReleaseEvent(last_event);
+		last_event = 0;
 	}
 
 	int err;
-	if((err = clEnqueueNDRangeKernel(cmdq, kernel, dim, 0, global_size, 0,
-					wait_event ? 1 : 0, wait_event ? &wait_event : 0, &last_event)) != 0) {
+	cl_event pev;
+	if((err = clEnqueueNDRangeKernel(cmdq, kernel, dim, 0, global_size, local_size,
+					wait_event ? 1 : 0, wait_event ? &wait_event : 0, &pev)) != 0) {
 		fprintf(stderr, "error executing kernel: %s\n", clstrerror(err));
 		return false;
 	}
+	prof_record(PROF_KERNEL, kname.c_str(), pev, &last_event);
+
+	if(wait_event) {
+		clReleaseEvent(wait_event);
+		wait_event = 0;
+	}
+	return true;
+}
+
+int CLProgram::get_work_group_size(int dev) const
+{
+	size_t sz;
+	int err;
+
+	if(!kernel || dev < 0 || dev >= num_devices) {
+		return 0;
+	}
+	if((err = clGetKernelWorkGroupInfo(kernel, devices[dev], CL_KERNEL_WORK_GROUP_SIZE, sizeof sz, &sz, 0)) != 0) {
+		fprintf(stderr, "failed to query the work group size of %s: %s\n", kname.c_str(), clstrerror(err));
+		return 0;
+	}
+	return (int)sz;
+}
+
+bool CLProgram::run_bands(int fb_arg, const size_t *global_size, const size_t *local_size, const int *rows) const
+{
+	int err;
+	cl_event marker;
+	CLMemBuffer *fb = args[fb_arg].v.mbuf;
+
+	release_bands();
+
+	/* the other queues have to wait for whatever was queued on the primary one
+	 * before this (buffer updates, acquiring the framebuffer)
+	 */
+	if((err = clEnqueueMarker(cmdq, &marker)) != 0) {
+		fprintf(stderr, "failed to enqueue marker: %s\n", clstrerror(err));
+		return false;
+	}
+
+	int start = 0;
+	for(int i=0; i<num_devices && start < (int)global_size[1]; i++) {
+		if(rows[i] <= 0) {
+			continue;
+		}
+
+		size_t offs[2], gsz[2];
+		const size_t *lsz = local_size;
+		if(lsz && (int)(lsz[0] * lsz[1]) > get_work_group_size(i)) {
+			lsz = 0;
+		}
+
+		offs[0] = 0;
+		offs[1] = start;
+		gsz[0] = global_size[0];
+		gsz[1] = MIN(rows[i], (int)global_size[1] - start);
+		if(lsz) {
+			gsz[1] = (gsz[1] + lsz[1] - 1) / lsz[1] * lsz[1];
+		}
+
+		cl_event wait[3];
+		int num_wait = 0;
+		if(wait_event) {
+			wait[num_wait++] = wait_event;
+		}
+
+		/* devices may not write the same image concurrently, so the others
+		 * render to an image of their own, which is copied over afterwards.
+		 * The copy of the previous frame has to be done before it's reused.
+		 */
+		if(i > 0) {
+			CLMemBuffer *img = get_band_image(i, fb->xsz, fb->ysz);
+			if(!img) {
+				clReleaseEvent(marker);
+				return false;
+			}
+			clSetKernelArg(kernel, fb_arg, sizeof img->mem, &img->mem);
+
+			wait[num_wait++] = marker;
+			if(band_copy_ev[i]) {
+				wait[num_wait++] = band_copy_ev[i];
+			}
+		}
+
+		Band band;
+		band.dev = i;
+		band.start = start;
+		band.rows = gsz[1];
+		cl_event pev;
+		err = clEnqueueNDRangeKernel(queues[i], kernel, 2, offs, gsz, lsz, num_wait, num_wait ? wait : 0, &pev);
+
+		if(i > 0) {
+			clSetKernelArg(kernel, fb_arg, sizeof fb->mem, &fb->mem);
+		}
+		if(err != 0) {
+			fprintf(stderr, "error executing kernel on device %d: %s\n", i, clstrerror(err));
+			clReleaseEvent(marker);
+			return false;
+		}
+		if(i > 0) {
+			clFlush(queues[i]);
+		}
+		char name[128];
+		sprintf(name, "%.100s (device %d)", kname.c_str(), i);
+		prof_record(PROF_KERNEL, name, pev, &band.ev);
+
+		bands.push_back(band);
+		start += gsz[1];
+	}
+	clReleaseEvent(marker);
 
 	if(wait_event) {
 		clReleaseEvent(wait_event);
 		wait_event = 0;
 	}
+
+	// copy the bands of the other devices to the framebuffer, on the primary queue
+	for(size_t i=0; i<bands.size(); i++) {
+		int dev = bands[i].dev;
+		if(!dev) continue;
+
+		size_t orig[] = {0, (size_t)bands[i].start, 0};
+		size_t rgn[] = {fb->xsz, MIN((size_t)bands[i].rows, fb->ysz - bands[i].start), 1};
+
+		if(band_copy_ev[dev]) {
+			clReleaseEvent(band_copy_ev[dev]);
+		}
+		cl_event pev;
+		band_copy_ev[dev] = 0;
+		if((err = clEnqueueCopyImage(cmdq, band_img[dev]->mem, fb->mem, orig, orig, rgn, 1,
+						&bands[i].ev, &pev)) != 0) {
+			fprintf(stderr, "failed to copy the band of device %d: %s\n", dev, clstrerror(err));
+			return false;
+		}
+		prof_record(PROF_COPY, "band copy", pev, band_copy_ev + dev);
+	}
+	return true;
+}
+
+int CLProgram::get_band_times(int *rows, double *msec) const
+{
+	if(bands.empty()) {
+		return 0;
+	}
+
+	for(int i=0; i<num_devices; i++) {
+		rows[i] = 0;
+		msec[i] = 0.0;
+	}
+
+	for(size_t i=0; i<bands.size(); i++) {
+		cl_ulong start, end;
+
+		clWaitForEvents(1, &bands[i].ev);
+		if(clGetEventProfilingInfo(bands[i].ev, CL_PROFILING_COMMAND_START, sizeof start, &start, 0) != 0 ||
+				clGetEventProfilingInfo(bands[i].ev, CL_PROFILING_COMMAND_END, sizeof end, &end, 0) != 0) {
+			continue;
+		}
+		rows[bands[i].dev] = bands[i].rows;
+		msec[bands[i].dev] = (double)(end - start) / 1000000.0;
+	}
+
+	release_bands();
+	return num_devices;
+}
+
+void CLProgram::release_bands() const
+{
+	for(size_t i=0; i<bands.size(); i++) {
+		clReleaseEvent(bands[i].ev);
+	}
+	bands.clear();
+}
+
+/* work-group shapes tried by tune_local_size, 0x0 leaves it to the driver */
+static const int tile_shapes[][2] = {
+	{0, 0}, {8, 8}, {16, 8}, {8, 16}, {16, 16}, {32, 8}, {32, 4},
+	{64, 4}, {64, 2}, {64, 1}, {16, 4}, {8, 4}, {4, 4}
+};
+
+#define TILE_CACHE_FILE		"/tiles"
+#define TUNE_MSEC			50
+
+bool CLProgram::tune_local_size(int xsz, int ysz, size_t *local_size)
+{
+	FILE *fp;
+	char line[1024];
+	int max_wg = get_work_group_size();
+
+	if(!max_wg) {
+		return false;
+	}
+
+	std::string key = cache_key(0) + "|" + kname;
+	std::string fname = cache_dir + TILE_CACHE_FILE;
+
+	if(!cache_dir.empty() && (fp = fopen(fname.c_str(), "rb"))) {
+		while(fgets(line, sizeof line, fp)) {
+			char *tab = strrchr(line, '\t');
+			int lx, ly;
+
+			if(!tab || std::string(line, tab) != key || sscanf(tab + 1, "%d %d", &lx, &ly) != 2) {
+				continue;
+			}
+			if(lx >= 0 && ly >= 0 && lx * ly <= max_wg) {
+				local_size[0] = lx;
+				local_size[1] = ly;
+				fclose(fp);
+				return true;
+			}
+		}
+		fclose(fp);
+	}
+
+	printf("tuning the work-group size of %s\n", kname.c_str());
+
+	long best_time = LONG_MAX;
+	int best = -1;
+
+	for(int i=0; i<(int)(sizeof tile_shapes / sizeof *tile_shapes); i++) {
+		size_t lsz[2], gsz[2];
+		lsz[0] = tile_shapes[i][0];
+		lsz[1] = tile_shapes[i][1];
+
+		if((int)(lsz[0] * lsz[1]) > max_wg || (devinf.dim >= 2 &&
+					(lsz[0] > devinf.work_item_sizes[0] || lsz[1] > devinf.work_item_sizes[1]))) {
+			continue;
+		}
+		for(int j=0; j<2; j++) {
+			size_t dim_sz = j ? ysz : xsz;
+			gsz[j] = lsz[j] ? (dim_sz + lsz[j] - 1) / lsz[j] * lsz[j] : dim_sz;
+		}
+		const size_t *lptr = lsz[0] ? lsz : 0;
+
+		// the first run is a warm-up, then keep going until we have enough time to compare
+		if(!run_ndrange(2, gsz, lptr)) {
+			continue;
+		}
+		clFinish(cmdq);
+
+		long start = get_msec(), dt;
+		int runs = 0;
+		do {
+			if(!run_ndrange(2, gsz, lptr)) {
+				break;
+			}
+			clFinish(cmdq);
+			runs++;
+		} while((dt = get_msec() - start) < TUNE_MSEC);
+
+		if(!runs) {
+			continue;
+		}
+		dt = dt * 1000 / runs;	// usec per run
+		printf("  %dx%d: %ld usec\n", (int)lsz[0], (int)lsz[1], dt);
+
+		if(dt < best_time) {
+			best_time = dt;
+			best = i;
+		}
+	}
+
+	if(best == -1) {
+		return false;
+	}
+	local_size[0] = tile_shapes[best][0];
+	local_size[1] = tile_shapes[best][1];
+	printf("using %dx%d work-groups for %s\n", (int)local_size[0], (int)local_size[1], kname.c_str());
+
+	if(!cache_dir.empty()) {
+		make_cache_dir();
+		if((fp = fopen(fname.c_str(), "ab"))) {
+			fprintf(fp, "%s\t%d %d\n", key.c_str(), (int)local_size[0], (int)local_size[1]);
+			fclose(fp);
+		}
+	}
 	return true;
 }
 
@@ -711,6 +1368,295 @@ static int select_device(struct device_info *dev_inf, int (*devcmp)(struct devic
 	return -1;
 }
 
+static CLMemBuffer *get_band_image(int dev, int xsz, int ysz)
+{
+	CLMemBuffer *img = band_img[dev];
+	if(img && (int)img->xsz == xsz && (int)img->ysz == ysz) {
+		return img;
+	}
+
+	if(band_copy_ev[dev]) {
+		clWaitForEvents(1, band_copy_ev + dev);
+		clReleaseEvent(band_copy_ev[dev]);
+		band_copy_ev[dev] = 0;
+	}
+	destroy_mem_buffer(img);
+	return band_img[dev] = create_image_buffer(ARG_RDWR, xsz, ysz);
+}
+
+/* ---- benchmark-driven device selection ----
+ * Every usable device runs the same ray/triangle intersection kernel, and the
+ * fastest one is picked. The choice is kept in the cache directory along with
+ * the list of devices it was made from, so it's only measured again when the
+ * devices or their drivers change.
+ */
+#define BENCH_RAYS		65536
+#define BENCH_TRIS		256
+#define BENCH_MSEC		100
+#define DEVICE_CACHE_FILE	"/device"
+
+static const char *bench_src =
+	"kernel void bench(global const float4 *tris, int num_tris, global float *res)\n"
+	"{\n"
+	"	int idx = get_global_id(0);\n"
+	"	float u = (float)(idx & 255) / 128.0f - 1.0f;\n"
+	"	float v = (float)((idx >> 8) & 255) / 128.0f - 1.0f;\n"
+	"	float3 dir = normalize((float3)(u, v, -1.0f));\n"
+	"	float nearest = 1e30f;\n"
+	"\n"
+	"	for(int i=0; i<num_tris; i++) {\n"
+	"		float3 v0 = tris[i * 3].xyz;\n"
+	"		float3 e1 = tris[i * 3 + 1].xyz - v0;\n"
+	"		float3 e2 = tris[i * 3 + 2].xyz - v0;\n"
+	"		float3 p = cross(dir, e2);\n"
+	"		float det = dot(e1, p);\n"
+	"		if(fabs(det) < 1e-6f) continue;\n"
+	"		float inv_det = 1.0f / det;\n"
+	"		float a = dot(-v0, p) * inv_det;\n"
+	"		if(a < 0.0f || a > 1.0f) continue;\n"
+	"		float3 q = cross(-v0, e1);\n"
+	"		float b = dot(dir, q) * inv_det;\n"
+	"		if(b < 0.0f || a + b > 1.0f) continue;\n"
+	"		float t = dot(e2, q) * inv_det;\n"
+	"		if(t > 0.0f && t < nearest) nearest = t;\n"
+	"	}\n"
+	"	res[idx] = nearest;\n"
+	"}\n";
+
+static int select_device_bench(struct device_info *di)
+{
+	cl_platform_id plat[32], cand_plat[64];
+	cl_device_id cand[64];
+	cl_uint num_plat;
+	int num_cand = 0;
+
+	if(clGetPlatformIDs(32, plat, &num_plat) != 0 || !num_plat) {
+		return -1;
+	}
+
+	// OCL_ICD still restricts the search to one platform
+	unsigned int first_plat = 0, last_plat = num_plat;
+	char *icd_env = getenv("OCL_ICD");
+	if(icd_env && (unsigned int)atoi(icd_env) < num_plat) {
+		first_plat = atoi(icd_env);
+		last_plat = first_plat + 1;
+	}
+
+	for(unsigned int i=first_plat; i<last_plat; i++) {
+		cl_device_id dev[32];
+		cl_uint num_dev;
+
+		if(clGetDeviceIDs(plat[i], CL_DEVICE_TYPE_ALL, 32, dev, &num_dev) != 0) {
+			continue;
+		}
+		for(unsigned int j=0; j<num_dev && num_cand < 64; j++) {
+			struct device_info info;
+			cl_bool avail = 0, compiler = 0;
+
+			get_dev_info(dev[j], &info);
+			clGetDeviceInfo(dev[j], CL_DEVICE_AVAILABLE, sizeof avail, &avail, 0);
+			clGetDeviceInfo(dev[j], CL_DEVICE_COMPILER_AVAILABLE, sizeof compiler, &compiler, 0);
+
+			bool usable = avail && compiler && info.image_support;
+#ifdef CLGL_INTEROP
+			usable = usable && info.gl_sharing;
+#endif
+			destroy_dev_info(&info);
+
+			if(usable) {
+				cand_plat[num_cand] = plat[i];
+				cand[num_cand++] = dev[j];
+			}
+		}
+	}
+
+	if(!num_cand) {
+		return -1;
+	}
+
+	std::string devlist;
+	for(int i=0; i<num_cand; i++) {
+		devlist += dev_key(cand[i]) + (i < num_cand - 1 ? "\t" : "");
+	}
+
+	int sel = -1;
+	std::string fname = cache_dir + DEVICE_CACHE_FILE;
+	FILE *fp;
+
+	if(num_cand == 1) {
+		sel = 0;
+	} else if(!cache_dir.empty() && (fp = fopen(fname.c_str(), "rb"))) {
+		std::string line[2];
+		char buf[512];
+
+		for(int i=0; i<2; i++) {
+			while(fgets(buf, sizeof buf, fp)) {
+				line[i] += buf;
+				if(line[i][line[i].size() - 1] == '\n') {
+					line[i].erase(line[i].size() - 1);
+					break;
+				}
+			}
+		}
+		fclose(fp);
+
+		if(line[0] == devlist) {
+			for(int i=0; i<num_cand; i++) {
+				if(dev_key(cand[i]) == line[1]) {
+					sel = i;
+					break;
+				}
+			}
+		}
+	}
+
+	if(sel == -1) {
+		double best = 0.0;
+
+		printf("benchmarking %d devices\n", num_cand);
+		for(int i=0; i<num_cand; i++) {
+			double msec = bench_device(cand_plat[i], cand[i]);
+			if(msec < 0.0) {
+				printf("  %s: failed\n", get_dev_string(cand[i], CL_DEVICE_NAME).c_str());
+				continue;
+			}
+			printf("  %s: %.3f msec\n", get_dev_string(cand[i], CL_DEVICE_NAME).c_str(), msec);
+
+			if(sel == -1 || msec < best) {
+				best = msec;
+				sel = i;
+			}
+		}
+		if(sel == -1) {
+			return -1;
+		}
+
+		if(!cache_dir.empty()) {
+			make_cache_dir();
+			if((fp = fopen(fname.c_str(), "wb"))) {
+				fprintf(fp, "%s\n%s\n", devlist.c_str(), dev_key(cand[sel]).c_str());
+				fclose(fp);
+			}
+		}
+	}
+
+	get_dev_info(cand[sel], di);
+	printf("\nusing device: %s\n", get_dev_string(cand[sel], CL_DEVICE_NAME).c_str());
+	return 0;
+}
+
+// msec per run of the benchmark kernel, or -1 if it couldn't run on the device
+static double bench_device(cl_platform_id plat, cl_device_id dev)
+{
+	cl_context bctx = 0;
+	cl_command_queue bq = 0;
+	cl_program bprog = 0;
+	cl_kernel bkern = 0;
+	cl_mem tbuf = 0, rbuf = 0;
+	double res = -1.0;
+	int num_tris = BENCH_TRIS;
+	size_t gsz = BENCH_RAYS;
+
+	// small triangles scattered in front of the rays, most of them miss
+	cl_float4 *tris = new cl_float4[BENCH_TRIS * 3];
+	srand(0);
+	for(int i=0; i<BENCH_TRIS; i++) {
+		float x = 8.0 * rand() / RAND_MAX - 4.0;
+		float y = 8.0 * rand() / RAND_MAX - 4.0;
+		float z = -2.0 - 8.0 * rand() / RAND_MAX;
+
+		for(int j=0; j<3; j++) {
+			cl_float4 *v = tris + i * 3 + j;
+			v->s[0] = x + (float)rand() / RAND_MAX - 0.5;
+			v->s[1] = y + (float)rand() / RAND_MAX - 0.5;
+			v->s[2] = z + (float)rand() / RAND_MAX - 0.5;
+			v->s[3] = 1.0;
+		}
+	}
+
+	cl_context_properties prop[] = {CL_CONTEXT_PLATFORM, (cl_context_properties)plat, 0};
+
+	if(!(bctx = clCreateContext(prop, 1, &dev, 0, 0, 0)) ||
+			!(bq = clCreateCommandQueue(bctx, dev, 0, 0)) ||
+			!(bprog = clCreateProgramWithSource(bctx, 1, &bench_src, 0, 0)) ||
+			clBuildProgram(bprog, 1, &dev, "-cl-fast-relaxed-math", 0, 0) != 0 ||
+			!(bkern = clCreateKernel(bprog, "bench", 0)) ||
+			!(tbuf = clCreateBuffer(bctx, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+					BENCH_TRIS * 3 * sizeof *tris, tris, 0)) ||
+			!(rbuf = clCreateBuffer(bctx, CL_MEM_WRITE_ONLY, BENCH_RAYS * sizeof(float), 0, 0))) {
+		goto end;
+	}
+
+	clSetKernelArg(bkern, 0, sizeof tbuf, &tbuf);
+	clSetKernelArg(bkern, 1, sizeof num_tris, &num_tris);
+	clSetKernelArg(bkern, 2, sizeof rbuf, &rbuf);
+
+	// warm-up run, then as many as fit in BENCH_MSEC
+	if(clEnqueueNDRangeKernel(bq, bkern, 1, 0, &gsz, 0, 0, 0, 0) != 0 || clFinish(bq) != 0) {
+		goto end;
+	}
+	{
+		long start = get_msec(), dt;
+		int runs = 0;
+		do {
+			if(clEnqueueNDRangeKernel(bq, bkern, 1, 0, &gsz, 0, 0, 0, 0) != 0) {
+				goto end;
+			}
+			clFinish(bq);
+			runs++;
+		} while((dt = get_msec() - start) < BENCH_MSEC);
+
+		res = (double)dt / runs;
+	}
+
+end:
+	delete [] tris;
+	if(rbuf) clReleaseMemObject(rbuf);
+	if(tbuf) clReleaseMemObject(tbuf);
+	if(bkern) clReleaseKernel(bkern);
+	if(bprog) clReleaseProgram(bprog);
+	if(bq) clReleaseCommandQueue(bq);
+	if(bctx) clReleaseContext(bctx);
+	return res;
+}
+
+/* the rest of the devices on the platform of the selected one which can run
+ * our kernels.
+ */
+static int get_extra_devices(cl_device_id *dev, int max_dev)
+{
+	cl_platform_id plat;
+	cl_device_id devlist[32];
+	cl_uint num;
+	int count = 0;
+
+	if(clGetDeviceInfo(devinf.id, CL_DEVICE_PLATFORM, sizeof plat, &plat, 0) != 0 ||
+			clGetDeviceIDs(plat, CL_DEVICE_TYPE_ALL, 32, devlist, &num) != 0) {
+		return 0;
+	}
+
+	for(unsigned int i=0; i<num && count < max_dev; i++) {
+		cl_bool avail = 0, compiler = 0, img = 0;
+
+		if(devlist[i] == devinf.id) {
+			continue;
+		}
+		clGetDeviceInfo(devlist[i], CL_DEVICE_AVAILABLE, sizeof avail, &avail, 0);
+		clGetDeviceInfo(devlist[i], CL_DEVICE_COMPILER_AVAILABLE, sizeof compiler, &compiler, 0);
+		clGetDeviceInfo(devlist[i], CL_DEVICE_IMAGE_SUPPORT, sizeof img, &img, 0);
+
+		if(avail && compiler && img) {
+			char name[256];
+			clGetDeviceInfo(devlist[i], CL_DEVICE_NAME, sizeof name, name, 0);
+			name[sizeof name - 1] = 0;
+			printf("also using device: %s\n", name);
+
+			dev[count++] = devlist[i];
+		}
+	}
+	return count;
+}
+
 static int get_dev_info(cl_device_id dev, struct device_info *di)
 {
 	di->id = dev;
@@ -725,6 +1671,9 @@ static int get_dev_info(cl_device_id dev, struct device_info *di)
 	clGetDeviceInfo(dev, CL_DEVICE_MAX_WORK_ITEM_SIZES, di->dim * sizeof *di->work_item_sizes, di->work_item_sizes, 0);
 	clGetDeviceInfo(dev, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof di->work_group_size, &di->work_group_size, 0);
 	clGetDeviceInfo(dev, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof di->mem_size, &di->mem_size, 0);
+	clGetDeviceInfo(dev, CL_DEVICE_IMAGE_SUPPORT, sizeof di->image_support, &di->image_support, 0);
+	clGetDeviceInfo(dev, CL_DEVICE_IMAGE2D_MAX_WIDTH, sizeof di->image2d_max_size[0], di->image2d_max_size, 0);
+	clGetDeviceInfo(dev, CL_DEVICE_IMAGE2D_MAX_HEIGHT, sizeof di->image2d_max_size[1], di->image2d_max_size + 1, 0);
 
 	size_t ext_str_len;
 	clGetDeviceInfo(dev, CL_DEVICE_EXTENSIONS, 0, 0, &ext_str_len);
@@ -800,3 +1749,246 @@ static const char *clstrerror(int err)
 	}
 	return ocl_errstr[-err];
 }
+
+/* reads an opencl source file, pasting in any quoted #include files (relative
+ * to the including file) so that the whole program is in one string. This way
+ * it doesn't depend on the -I build options, and the cache key covers the
+ * included headers as well.
+ */
+static bool read_source(const char *fname, std::string *dest, int depth)
+{
+	FILE *fp;
+	char buf[512];
+	int line = 0;
+
+	if(!(fp = fopen(fname, "rb"))) {
+		fprintf(stderr, "failed to open %s: %s\n", fname, strerror(errno));
+		return false;
+	}
+
+	std::string dir = fname;
+	size_t slash = dir.find_last_of("/\\");
+	dir = slash == std::string::npos ? "" : dir.substr(0, slash + 1);
+
+	while(fgets(buf, sizeof buf, fp)) {
+		char *ptr = buf;
+		line++;
+
+		while(*ptr == ' ' || *ptr == '\t') ptr++;
+		if(*ptr == '#' && depth < 8) {
+			char *inc = ptr + 1;
+			while(*inc == ' ' || *inc == '\t') inc++;
+
+			char *end;
+			if(memcmp(inc, "include", 7) == 0 && (inc = strchr(inc + 7, '"')) &&
+					(end = strchr(inc + 1, '"'))) {
+				std::string incname = dir + std::string(inc + 1, end);
+
+				*dest += "#line 1 \"" + incname + "\"\n";
+				if(!read_source(incname.c_str(), dest, depth + 1)) {
+					fclose(fp);
+					return false;
+				}
+				sprintf(buf, "\n#line %d \"", line + 1);
+				*dest += buf + std::string(fname) + "\"\n";
+				continue;
+			}
+		}
+		*dest += buf;
+	}
+
+	fclose(fp);
+	return true;
+}
+
+// 32bit FNV-1a, continuing from a previous hash value
+static unsigned long fnv_hash(const std::string &str, unsigned long hash = 2166136261UL)
+{
+	for(size_t i=0; i<str.size(); i++) {
+		hash = ((hash ^ (unsigned char)str[i]) * 16777619UL) & 0xffffffffUL;
+	}
+	return hash;
+}
+
+static std::string get_dev_string(cl_device_id dev, cl_device_info what)
+{
+	size_t sz;
+	if(clGetDeviceInfo(dev, what, 0, 0, &sz) != 0) {
+		return "";
+	}
+	char *str = (char*)alloca(sz + 1);
+	clGetDeviceInfo(dev, what, sz, str, 0);
+	str[sz] = 0;
+	return str;
+}
+
+// identifies a device and its driver, on a single line
+static std::string dev_key(cl_device_id dev)
+{
+	std::string key = get_dev_string(dev, CL_DEVICE_NAME);
+	key += "|" + get_dev_string(dev, CL_DEVICE_VERSION);
+	key += "|" + get_dev_string(dev, CL_DRIVER_VERSION);
+
+	for(size_t i=0; i<key.size(); i++) {
+		if(key[i] == '\n' || key[i] == '\r' || key[i] == '\t') {
+			key[i] = ' ';
+		}
+	}
+	return key;
+}
+
+/* binaries are only valid for the device and driver they were built with, so
+ * these go in the key along with the build options. The source is hashed
+ * separately (see below).
+ */
+static std::string cache_key(const char *opt)
+{
+	std::string key = dev_key(devinf.id) + "|";
+	key += opt ? opt : "";
+
+	// the key is stored on a single line of the cache file header
+	for(size_t i=0; i<key.size(); i++) {
+		if(key[i] == '\n' || key[i] == '\r') {
+			key[i] = ' ';
+		}
+	}
+	return key;
+}
+
+static std::string cache_fname(const std::string &key, const std::string &src)
+{
+	char buf[32];
+	sprintf(buf, "/%08lx.clbin", fnv_hash(src, fnv_hash(key)));
+	return cache_dir + buf;
+}
+
+/* cache file format:
+ * line 1: "clray-binary 1"
+ * line 2: the cache key
+ * line 3: <source hash> <binary size>
+ * followed by the program binary.
+ */
+static cl_program load_cached_binary(const std::string &key, const std::string &src, const char *opt)
+{
+	FILE *fp;
+	char line[1024];
+	unsigned long src_hash, binsz;
+	size_t sz;
+	unsigned char *bin;
+	cl_program prog;
+	int err, status;
+
+	std::string fname = cache_fname(key, src);
+	if(!(fp = fopen(fname.c_str(), "rb"))) {
+		return 0;
+	}
+
+	if(!fgets(line, sizeof line, fp) || strcmp(line, "clray-binary 1\n") != 0 ||
+			!fgets(line, sizeof line, fp) || key + "\n" != line ||
+			!fgets(line, sizeof line, fp) || sscanf(line, "%lx %lu", &src_hash, &binsz) != 2 ||
+			src_hash != fnv_hash(src)) {
+		fprintf(stderr, "ignoring stale program cache file: %s\n", fname.c_str());
+		fclose(fp);
+		return 0;
+	}
+
+	sz = binsz;
+	bin = new unsigned char[sz];
+	if(fread(bin, 1, sz, fp) < sz) {
+		fprintf(stderr, "truncated program cache file: %s\n", fname.c_str());
+		delete [] bin;
+		fclose(fp);
+		return 0;
+	}
+	fclose(fp);
+
+	prog = clCreateProgramWithBinary(ctx, 1, &devinf.id, &sz, (const unsigned char**)&bin, &status, &err);
+	delete [] bin;
+	if(!prog || err != 0 || status != 0) {
+		fprintf(stderr, "failed to load cached program binary %s: %s\n", fname.c_str(),
+				clstrerror(err ? err : status));
+		if(prog) {
+			clReleaseProgram(prog);
+		}
+		return 0;
+	}
+
+	// binaries still need a build call, but it's just the final link
+	if(clBuildProgram(prog, 0, 0, opt, 0, 0) != 0) {
+		fprintf(stderr, "failed to build cached program binary %s, rebuilding from source\n", fname.c_str());
+		clReleaseProgram(prog);
+		return 0;
+	}
+
+	printf("using cached program binary: %s\n", fname.c_str());
+	return prog;
+}
+
+static void save_cached_binary(cl_program prog, const std::string &key, const std::string &src)
+{
+	FILE *fp;
+	size_t sz;
+	unsigned char *bin;
+
+	make_cache_dir();
+
+	// we only build for a single device, so there's a single binary
+	if(clGetProgramInfo(prog, CL_PROGRAM_BINARY_SIZES, sizeof sz, &sz, 0) != 0 || !sz) {
+		return;
+	}
+	bin = new unsigned char[sz];
+	if(clGetProgramInfo(prog, CL_PROGRAM_BINARIES, sizeof bin, &bin, 0) != 0) {
+		delete [] bin;
+		return;
+	}
+
+	std::string fname = cache_fname(key, src);
+	if(!(fp = fopen(fname.c_str(), "wb"))) {
+		fprintf(stderr, "failed to write program cache file %s: %s\n", fname.c_str(), strerror(errno));
+		delete [] bin;
+		return;
+	}
+	fprintf(fp, "clray-binary 1\n%s\n%08lx %lu\n", key.c_str(), fnv_hash(src), (unsigned long)sz);
+	fwrite(bin, 1, sz, fp);
+	fclose(fp);
+	delete [] bin;
+}
+
+static void make_cache_dir()
+{
+#ifndef _MSC_VER
+	mkdir(cache_dir.c_str(), 0775);
+#else
+	_mkdir(cache_dir.c_str());
+#endif
+}
+
+/* rounds up to a multiple of a quarter of the next lower power of two, which
+ * wastes at most 25% while keeping the number of classes small.
+ */
+static size_t pool_class_size(size_t sz)
+{
+	if(sz <= MIN_POOL_SIZE) {
+		return MIN_POOL_SIZE;
+	}
+
+	size_t pow2 = MIN_POOL_SIZE;
+	while(pow2 <= sz / 2) {
+		pow2 <<= 1;
+	}
+	size_t step = pow2 / 4;
+	return (sz + step - 1) / step * step;
+}
+
+static CLMemBuffer *new_mem_buffer(int type, cl_mem mem, size_t sz)
+{
+	CLMemBuffer *mbuf = new CLMemBuffer;
+	mbuf->type = type;
+	mbuf->mem = mem;
+	mbuf->size = sz;
+	mbuf->xsz = mbuf->ysz = 0;
+	mbuf->ptr = 0;
+	mbuf->tex = 0;
+	mbuf->pool_size = 0;
+	return mbuf;
+}
@@ -10,6 +10,8 @@
 #include <OpenCL/opencl.h>
 #endif
 
+#define MAX_DEVICES	8
+
 enum {
 	ARG_RD		= CL_MEM_READ_ONLY,
 	ARG_WR		= CL_MEM_WRITE_ONLY,
@@ -27,6 +29,12 @@ enum {
 	IMAGE_BUFFER
 };
 
+// channel types of RGBA images
+enum {
+	IMG_FLOAT	= CL_FLOAT,
+	IMG_UINT	= CL_UNSIGNED_INT32
+};
+
 struct CLMemBuffer {
 	int type;
 	cl_mem mem;
@@ -35,17 +43,81 @@ struct CLMemBuffer {
 	size_t xsz, ysz;
 	void *ptr;
 	unsigned int tex;
+
+	size_t pool_size;	// size class of a pooled buffer, 0 if it isn't pooled
 };
 
 
+// also use the rest of the devices of the platform, call before init_opencl
+void set_multi_device(bool enable);
+/* pick the device which runs a short raytracing benchmark the fastest, instead
+ * of going by compute units and clock. Call before init_opencl, and after
+ * set_program_cache_dir to keep the result.
+ */
+void set_device_benchmark(bool enable);
+
 bool init_opencl();
 void destroy_opencl();
 
 void finish_opencl();
+// submits the queued commands to the device without waiting for them
+void flush_opencl();
+
+// number of devices in the context, the first one is the primary
+int get_num_devices();
+
+// kinds of commands in the profile
+enum {
+	PROF_KERNEL,
+	PROF_WRITE,		// buffer writes
+	PROF_READ,		// buffer reads
+	PROF_MAP,		// mapping and unmapping buffers and images
+	PROF_COPY,		// copies between memory objects
+	PROF_GL,		// acquiring and releasing OpenGL objects
+
+	NUM_PROF_TYPES
+};
+
+// device times of a command in msec, from when the first command of its set was queued
+struct ProfRecord {
+	int type;
+	std::string name;
+	double queued, submit, start, end;
+};
 
+/* appends the times of the commands queued since the last call, in the order
+ * they were queued, and returns how many there were. Unless wait is true, the
+ * ones which haven't finished yet are left for the next call.
+ */
+int get_profile(std::vector<ProfRecord> *recs, bool wait = true);
+
+// number of compute units of the selected device
+int get_num_compute_units();
+// largest 2D image the device can hold, false if it has no image support
+bool get_image2d_max_size(size_t *xsz, size_t *ysz);
+
+/* built program binaries are cached in this directory, and reused on the next
+ * run if the device, driver, source and build options all match. Null or an
+ * empty string disables the cache.
+ */
+void set_program_cache_dir(const char *dir);
+
+/* plain buffers come from a pool of released ones, with sizes rounded up to
+ * a few classes per power of two, so creating and destroying transient buffers
+ * doesn't go to the driver every time.
+ */
 CLMemBuffer *create_mem_buffer(int rdwr, size_t sz, const void *buf);
+// releases the buffers kept in the pool, destroy_opencl calls it too
+void release_mem_pool();
+
+/* packs num buffers in a single memory object, each part starting at an offset
+ * aligned as the devices require it. parts receives a sub-buffer for each one,
+ * which have to be destroyed before the returned parent buffer. Data pointers
+ * may be null for parts without initial contents.
+ */
+CLMemBuffer *create_mem_arena(int rdwr, int num, const size_t *sizes, const void * const *data, CLMemBuffer **parts);
 
-CLMemBuffer *create_image_buffer(int rdwr, int xsz, int ysz, const void *pixels = 0);
+CLMemBuffer *create_image_buffer(int rdwr, int xsz, int ysz, const void *pixels = 0, int chan_type = IMG_FLOAT);
 CLMemBuffer *create_image_buffer(int rdwr, unsigned int tex);
 
 void destroy_mem_buffer(CLMemBuffer *mbuf);
@@ -54,6 +126,8 @@ void *map_mem_buffer(CLMemBuffer *mbuf, int rdwr, cl_event *ev = 0);
 void unmap_mem_buffer(CLMemBuffer *mbuf, cl_event *ev = 0);
 
 bool write_mem_buffer(CLMemBuffer *mbuf, size_t sz, const void *src, cl_event *ev = 0);
+// doesn't wait for the write, src has to stay valid and unchanged until it's done
+bool write_mem_buffer_async(CLMemBuffer *mbuf, size_t sz, const void *src, cl_event *ev = 0);
 bool read_mem_buffer(CLMemBuffer *mbuf, size_t sz, void *dest, cl_event *ev = 0);
 
 bool acquire_gl_object(CLMemBuffer *mbuf, cl_event *ev = 0);
@@ -65,7 +139,8 @@ enum {
 	ARGTYPE_INT,
 	ARGTYPE_FLOAT,
 	ARGTYPE_FLOAT4,
-	ARGTYPE_MEM_BUF
+	ARGTYPE_MEM_BUF,
+	ARGTYPE_MEM_REF		// buffer owned by another program
 };
 
 struct CLArg {
@@ -84,6 +159,7 @@ struct CLArg {
 class CLProgram {
 private:
 	std::string kname;
+	std::string src, src_name;
 	cl_program prog;
 	cl_kernel kernel;
 	std::vector<CLArg> args;
@@ -91,17 +167,32 @@ private:
 	mutable cl_event wait_event;
 	mutable cl_event last_event;
 
+	struct Band {
+		int dev, start, rows;
+		cl_event ev;
+	};
+	mutable std::vector<Band> bands;	// kernels queued by the last run_bands
+
+	bool bind_arg(int idx);
+	void release_bands() const;
+
 public:
 	CLProgram(const char *kname);
 	~CLProgram();
 
 	bool load(const char *fname);
+	// uses source text which is already in memory (e.g. built into the executable)
+	bool load_source(const char *src, const char *name = 0);
 
 	bool set_argi(int arg, int val);
 	bool set_argf(int arg, float val);
 	bool set_arg_buffer(int arg, int rdwr, size_t sz, const void *buf = 0);
-	bool set_arg_image(int arg, int rdwr, int xsz, int ysz, const void *pix = 0);
+	bool set_arg_image(int arg, int rdwr, int xsz, int ysz, const void *pix = 0, int chan_type = IMG_FLOAT);
 	bool set_arg_texture(int arg, int rdwr, unsigned int tex);
+	/* binds a buffer of another program, it's not released along with this one.
+	 * Unlike the other buffer arguments it can be changed after building.
+	 */
+	bool set_arg_shared(int arg, CLMemBuffer *mbuf);
 	CLMemBuffer *get_arg_buffer(int arg);
 	int get_num_args() const;
 
@@ -109,6 +200,30 @@ public:
 
 	bool run() const;
 	bool run(int dim, ...) const;
+	// local_size may be null to let the implementation pick the work-group size
+	bool run_ndrange(int dim, const size_t *global_size, const size_t *local_size = 0) const;
+
+	/* runs a 2D range split in horizontal bands across the devices, rows[i]
+	 * rows of it on device i (none if it's 0), in the order of the devices.
+	 * fb_arg is the image the kernel writes to: the other devices get one of
+	 * their own, and their bands are copied to it on the primary queue, so
+	 * anything queued there afterwards sees the whole frame.
+	 */
+	bool run_bands(int fb_arg, const size_t *global_size, const size_t *local_size, const int *rows) const;
+	/* kernel time in msec of each device during the last run_bands, and the
+	 * rows it got. Waits for them to finish, and returns 0 if there wasn't any.
+	 */
+	int get_band_times(int *rows, double *msec) const;
+
+	// largest work-group size the built kernel can be launched with on a device
+	int get_work_group_size(int dev = 0) const;
+
+	/* finds the fastest 2D work-group shape for running the kernel over xsz x
+	 * ysz work-items by timing a few of them. The result is stored in the
+	 * program cache directory for this device, so later runs just read it back.
+	 * A 0x0 local size means that the driver's choice won.
+	 */
+	bool tune_local_size(int xsz, int ysz, size_t *local_size);
 
 	// sets an event that has to be completed before running the kernel
 	void set_wait_event(cl_event ev);
@@ -3,6 +3,9 @@
 #include <math.h>
 #include <limits.h>
 #include <assert.h>
+#include <map>
+#include <vector>
+#include <string>
 #include "rt.h"
 #include "ogl.h"
 #include "ocl.h"
@@ -15,28 +18,156 @@ enum {
 	KARG_FRAMEBUFFER,
 	KARG_RENDER_INFO,
 	KARG_FACES,
+	KARG_TRIS,
 	KARG_MATLIB,
 	KARG_LIGHTS,
-	KARG_PRIM_RAYS,
-	KARG_XFORM,
-	KARG_INVTRANS_XFORM,
+	KARG_CAMERA,
 	KARG_KDTREE,
+	KARG_KDLEAVES,
+	KARG_KDROPES,
 
 	NUM_KERNEL_ARGS
 };
 
+// extra arguments of render_persistent, after the ones it shares with render
+enum {
+	KARG_WORK_COUNTER = NUM_KERNEL_ARGS,
+	KARG_BATCH_SIZE
+};
+
+// wavefront pipeline kernels, in the order they run
+enum {
+	WF_GENERATE,
+	WF_EXTEND,
+	WF_SHADE,
+	WF_SHADOW,
+	WF_OUTPUT,
+
+	NUM_WF_KERNELS
+};
+
+// arguments of wf_extend, wf_shade and wf_shadow
+enum {
+	WFARG_RENDER_INFO,
+	WFARG_FACES,
+	WFARG_TRIS,
+	WFARG_MATLIB,
+	WFARG_LIGHTS,
+	WFARG_KDTREE,
+	WFARG_KDLEAVES,
+	WFARG_KDROPES,
+	WFARG_RAYS,
+	WFARG_HITS,
+	WFARG_PATHS,
+	WFARG_SHADOWS,
+	WFARG_COUNTS,
+	WFARG_QUEUE,
+	WFARG_ITER
+};
+
+// arguments of wf_generate
+enum {
+	WFGEN_RENDER_INFO,
+	WFGEN_CAMERA,
+	WFGEN_RAYS,
+	WFGEN_PATHS,
+	WFGEN_COUNTS
+};
+
+// arguments of wf_output
+enum {
+	WFOUT_FRAMEBUFFER,
+	WFOUT_RENDER_INFO,
+	WFOUT_PATHS
+};
+
+// sizes of the wavefront queue items (struct RayItem, Hit, PathState, ShadowItem in rt.cl)
+#define WF_RAY_ITEM_SIZE	48
+#define WF_HIT_SIZE			16
+#define WF_PATH_SIZE		32
+#define WF_SHADOW_ITEM_SIZE	112
+
+#define MIN(a, b)	((a) < (b) ? (a) : (b))
+#define MAX(a, b)	((a) > (b) ? (a) : (b))
+
 static void update_render_info();
-static Ray get_primary_ray(int x, int y, int w, int h, float vfov_deg);
-static float *create_kdimage(const KDNodeGPU *kdtree, int num_nodes, int *xsz_ret, int *ysz_ret);
+static void update_camera();
+static bool load_program(CLProgram *p);
+static bool init_wavefront();
+static void destroy_wavefront();
+static bool run_wavefront();
+static bool init_persistent();
+static bool run_persistent();
+static CLProgram *create_shared_program(const char *kname);
+static CLProgram *get_spec_program();
+static bool run_tiled(CLProgram *p);
+static bool run_split(CLProgram *p, const size_t *gsize);
+static bool init_pipeline();
+static bool bind_framebuffer(int idx);
+static bool present_frame(int idx);
+static void collect_profile(bool wait);
+static bool create_scene_buffers(const int *args, const size_t *sizes, const void * const *data, int num);
+static void destroy_scene_buffers();
+static unsigned int *create_kdimage(const KDNodeGPU *kdtree, int num_nodes, int *xsz_ret, int *ysz_ret);
 
-static Face *faces;
-static Ray *prim_rays;
 static CLProgram *prog;
 static int global_size;
 
+#define BUILD_OPT	"-Isrc -cl-mad-enable -cl-single-precision-constant -cl-fast-relaxed-math"
+static char build_opt[256] = BUILD_OPT;
+
+#ifdef EMBED_KERNELS
+// rt.cl with common.h pasted in, generated by the makefile (make embed=1)
+static const char *rt_cl_src =
+#include "rt_cl.inc"
+	;
+#endif
+
+static bool kdtree_buffer;	// kd-tree nodes in a buffer instead of an image, see rt.cl
+static bool kdtree_ropes;	// stackless traversal with ropes
+
+static bool wavefront;
+static CLProgram *wfprog[NUM_WF_KERNELS];	// created the first time wavefront mode is used
+
+static bool persistent;
+static int batch_size = 4;	// pixels per work-item fetched at once by render_persistent
+static CLProgram *pprog;	// created the first time persistent mode is used
+
+static bool specialize = true;
+static std::map<std::string, CLProgram*> spec_progs;	// render kernels by build options
+
+static bool tune_tiles = true;
+static bool tiles_tuned;
+static size_t tile_size[2];	// work-group shape of the render kernel, 0x0 lets the driver pick
+
+/* with the scene arena, the static scene buffers are sub-buffers of a single
+ * memory object which we own, and the kernels get them as shared arguments.
+ */
+static bool scene_arena;
+static CLMemBuffer *arena_buf;
+static CLMemBuffer *arena_parts[NUM_KERNEL_ARGS];
+static int num_arena_parts;
+
+static float dev_share[MAX_DEVICES];	// part of the frame rendered by each device with multiple devices
+
+/* in pipelined mode frames alternate between two framebuffers, and render
+ * returns as soon as a frame is queued, presenting the one queued before it.
+ * With CL/GL interop each framebuffer is a texture, otherwise the finished
+ * one is copied to the single display texture.
+ */
+static bool pipeline;
+static CLMemBuffer *fbuf[2];	// the second is created the first time pipelining is used
+static unsigned int fbtex[2];
+static int cur_fb, bound_fb;	// the framebuffer of the next frame, and the one the kernels write to
+static int pending_fb = -1;		// the frame still in flight, if any
+static cl_event pending_ev;
+
 
 static RendInfo rinf;
+static Camera cam;
+static float vfov_deg = 45.0;
 static RenderStats rstat;
+static std::vector<ProfRecord> frame_prof;	// commands of the last frame
 static int saved_iter_val;
 
 static long timing_sample_sum;
@@ -56,66 +187,118 @@ bool init_renderer(int xsz, int ysz, Scene *scn, unsigned int tex)
 	rinf.max_iter = saved_iter_val = 6;
 	rinf.cast_shadows = true;
 
-	/* calculate primary rays */
-	prim_rays = new Ray[xsz * ysz];
-
-	for(int i=0; i<ysz; i++) {
-		for(int j=0; j<xsz; j++) {
-			prim_rays[i * xsz + j] = get_primary_ray(j, i, xsz, ysz, 45.0);
-		}
-	}
-	dbg_set_primary_rays(prim_rays);	// give them to the debug renderer
+	// camera at the origin looking down -Z, until set_xform is called
+	memset(&cam, 0, sizeof cam);
+	cam.right[0] = cam.up[1] = cam.back[2] = 1.0;
+	cam.vfov = M_PI * vfov_deg / 180.0;
 
 	/* setup opencl */
 	prog = new CLProgram("render");
-	if(!prog->load("src/rt.cl")) {
+	if(!load_program(prog)) {
 		return false;
 	}
 
-	if(!(faces = (Face*)scn->get_face_buffer())) {
-		fprintf(stderr, "failed to create face buffer\n");
+	/* the kernel gets the faces split in two: the positions (as intersection
+	 * records) which traversal reads, and the rest which is only read by shading.
+	 */
+	const TriAccel *tris = scn->get_tri_accel_buffer();
+	const FaceShading *shading = scn->get_face_shading_buffer();
+	if(!tris || !shading) {
+		fprintf(stderr, "failed to create face buffers\n");
 		return false;
 	}
 
-	const KDNodeGPU *kdbuf = scn->get_kdtree_buffer();
+	// with ropes the leaf nodes point to their ropes instead of their faces
+	const KDNodeGPU *kdbuf = kdtree_ropes ? scn->get_kdtree_rope_nodes() : scn->get_kdtree_buffer();
 	if(!kdbuf) {
 		fprintf(stderr, "failed to create kdtree buffer\n");
 		return false;
 	}
 
-	int kdimg_xsz, kdimg_ysz;
-	float *kdimg_pixels = create_kdimage(kdbuf, scn->get_num_kdnodes(), &kdimg_xsz, &kdimg_ysz);
+	for(int i=0; i<4; i++) {
+		rinf.kdtree_min[i] = i < 3 ? scn->kdtree->aabb.min[i] : 0.0;
+		rinf.kdtree_max[i] = i < 3 ? scn->kdtree->aabb.max[i] : 0.0;
+	}
+
+	// fall back to the buffer if the tree doesn't fit in the largest image
+	int num_nodes = scn->get_kdtree_buffer_size();
+
+	if(!kdtree_buffer) {
+		size_t img_max_xsz, img_max_ysz;
+		size_t img_ysz = ((num_nodes + 1) / 2 - 1) / KDIMG_MAX_WIDTH + 1;
+
+		if(!get_image2d_max_size(&img_max_xsz, &img_max_ysz) || img_max_xsz < KDIMG_MAX_WIDTH ||
+				img_max_ysz < img_ysz) {
+			printf("the kd-tree (%d nodes) doesn't fit in an image, using a buffer\n", num_nodes);
+			kdtree_buffer = true;
+		}
+	}
+	sprintf(build_opt, "%s%s%s", BUILD_OPT, kdtree_buffer ? " -DKDTREE_BUFFER" : "",
+			kdtree_ropes ? " -DKDTREE_ROPES" : "");
 
 	/* setup argument buffers */
 #ifdef CLGL_INTEROP
-	prog->set_arg_texture(KARG_FRAMEBUFFER, ARG_WR, tex);
+	fbtex[0] = tex;
+	fbuf[0] = create_image_buffer(ARG_WR, tex);
 #else
-	prog->set_arg_image(KARG_FRAMEBUFFER, ARG_WR, xsz, ysz);
+	fbuf[0] = create_image_buffer(ARG_WR, xsz, ysz);
 #endif
+	if(!fbuf[0]) {
+		return false;
+	}
+	// the framebuffers are swapped under the kernels in pipelined mode, so we own them
+	prog->set_arg_shared(KARG_FRAMEBUFFER, fbuf[0]);
 	prog->set_arg_buffer(KARG_RENDER_INFO, ARG_RD, sizeof rinf, &rinf);
-	prog->set_arg_buffer(KARG_FACES, ARG_RD, rinf.num_faces * sizeof(Face), faces);
-	prog->set_arg_buffer(KARG_MATLIB, ARG_RD, scn->get_num_materials() * sizeof(Material), scn->get_materials());
-	prog->set_arg_buffer(KARG_LIGHTS, ARG_RD, scn->get_num_lights() * sizeof(Light), scn->get_lights());
-	prog->set_arg_buffer(KARG_PRIM_RAYS, ARG_RD, xsz * ysz * sizeof *prim_rays, prim_rays);
-	prog->set_arg_buffer(KARG_XFORM, ARG_RD, 16 * sizeof(float));
-	prog->set_arg_buffer(KARG_INVTRANS_XFORM, ARG_RD, 16 * sizeof(float));
-	//prog->set_arg_buffer(KARG_KDTREE, ARG_RD, scn->get_num_kdnodes() * sizeof *kdbuf, kdbuf);
-	prog->set_arg_image(KARG_KDTREE, ARG_RD, kdimg_xsz, kdimg_ysz, kdimg_pixels);
-
-	delete [] kdimg_pixels;
+	prog->set_arg_buffer(KARG_CAMERA, ARG_RD, sizeof cam, &cam);
+
+	// the static scene data, the kd-tree only if it goes in a buffer
+	int scn_args[NUM_KERNEL_ARGS];
+	size_t scn_sizes[NUM_KERNEL_ARGS];
+	const void *scn_data[NUM_KERNEL_ARGS];
+	int num_scn_bufs = 0;
+
+#define ADD_SCENE_BUF(arg, sz, data)	\
+	do {	\
+		scn_args[num_scn_bufs] = arg;	\
+		scn_sizes[num_scn_bufs] = sz;	\
+		scn_data[num_scn_bufs++] = data;	\
+	} while(0)
+
+	ADD_SCENE_BUF(KARG_FACES, rinf.num_faces * sizeof *shading, shading);
+	ADD_SCENE_BUF(KARG_TRIS, rinf.num_faces * sizeof *tris, tris);
+	ADD_SCENE_BUF(KARG_MATLIB, scn->get_num_materials() * sizeof(Material), scn->get_materials());
+	ADD_SCENE_BUF(KARG_LIGHTS, scn->get_num_lights() * sizeof(Light), scn->get_lights());
+	if(kdtree_buffer) {
+		ADD_SCENE_BUF(KARG_KDTREE, num_nodes * sizeof *kdbuf, kdbuf);
+	} else {
+		int kdimg_xsz, kdimg_ysz;
+		unsigned int *kdimg_pixels = create_kdimage(kdbuf, num_nodes, &kdimg_xsz, &kdimg_ysz);
+
+		prog->set_arg_image(KARG_KDTREE, ARG_RD, kdimg_xsz, kdimg_ysz, kdimg_pixels, IMG_UINT);
+		delete [] kdimg_pixels;
+	}
+	ADD_SCENE_BUF(KARG_KDLEAVES, MAX(scn->get_num_kdtree_leaf_items(), 1) * sizeof(int),
+			scn->get_kdtree_leaf_buffer());
+	if(kdtree_ropes) {
+		ADD_SCENE_BUF(KARG_KDROPES, scn->get_num_kdtree_rope_leaves() * sizeof(KDLeafGPU),
+				scn->get_kdtree_rope_buffer());
+	} else {
+		ADD_SCENE_BUF(KARG_KDROPES, sizeof(KDLeafGPU), 0);	// unused
+	}
+#undef ADD_SCENE_BUF
 
+	if(!create_scene_buffers(scn_args, scn_sizes, scn_data, num_scn_bufs)) {
+		return false;
+	}
 
 	if(prog->get_num_args() < NUM_KERNEL_ARGS) {
 		return false;
 	}
 
-	const char *opt = "-Isrc -cl-mad-enable -cl-single-precision-constant -cl-fast-relaxed-math";
-	if(!prog->build(opt)) {
+	if(!prog->build(build_opt)) {
 		return false;
 	}
 
-	//delete [] prim_rays; now dbg_renderer handles them
-
 	global_size = xsz * ysz;
 
 
@@ -125,12 +308,41 @@ bool init_renderer(int xsz, int ysz, Scene *scn, unsigned int tex)
 
 void destroy_renderer()
 {
+	destroy_wavefront();
+	delete pprog;
+	pprog = 0;
+
+	std::map<std::string, CLProgram*>::iterator it = spec_progs.begin();
+	while(it != spec_progs.end()) {
+		delete it->second;
+		it++;
+	}
+	spec_progs.clear();
 	delete prog;
+	prog = 0;
+	destroy_scene_buffers();
+
+	if(pending_ev) {
+		clReleaseEvent(pending_ev);
+		pending_ev = 0;
+	}
+	pending_fb = -1;
+	for(int i=0; i<2; i++) {
+		destroy_mem_buffer(fbuf[i]);
+		fbuf[i] = 0;
+	}
+#ifdef CLGL_INTEROP
+	if(fbtex[1]) {
+		glDeleteTextures(1, fbtex + 1);
+		fbtex[1] = 0;
+	}
+#endif
 
 	destroy_dbg_renderer();
 
 	if(num_timing_samples) {
-		printf("rendertime mean: %ld msec\n", timing_sample_sum / num_timing_samples);
+		printf("rendertime mean: %ld msec (kd-tree %s%s)\n", timing_sample_sum / num_timing_samples,
+				kdtree_buffer ? "buffer" : "image", kdtree_ropes ? " with ropes" : "");
 	}
 }
 
@@ -143,49 +355,141 @@ bool render()
 	rstat.min_aabb_tests = rstat.min_triangle_tests = INT_MAX;
 	rstat.max_aabb_tests = rstat.max_triangle_tests = 0;
 
+	if(pipeline && !fbuf[1] && !init_pipeline()) {
+		fprintf(stderr, "failed to create the second framebuffer, pipelining disabled\n");
+		pipeline = false;
+	}
+	if(!pipeline) {
+		if(!finish_render()) {
+			return false;
+		}
+	}
+
+	if(wavefront && !wfprog[0] && !init_wavefront()) {
+		fprintf(stderr, "failed to set up the wavefront kernels, falling back to the single kernel\n");
+		wavefront = false;
+	}
+
+	if(persistent && !wavefront && !pprog && !init_persistent()) {
+		fprintf(stderr, "failed to set up the persistent-threads kernel, falling back to the regular one\n");
+		persistent = false;
+	}
+
+	// the kernel specialized for the current options, or the generic one if it failed to build
+	CLProgram *rprog = prog;
+	if(specialize && !wavefront && !persistent) {
+		CLProgram *sprog = get_spec_program();
+		if(sprog) {
+			rprog = sprog;
+		}
+	}
+
+	CLProgram *first = rprog;
+	if(wavefront) {
+		first = wfprog[WF_GENERATE];
+	} else if(persistent) {
+		first = pprog;
+	}
+
+	if(!bind_framebuffer(cur_fb)) {
+		return false;
+	}
+
 #ifdef CLGL_INTEROP
 	cl_event ev;
-	CLMemBuffer *texbuf = prog->get_arg_buffer(KARG_FRAMEBUFFER);
 
-	if(!acquire_gl_object(texbuf, &ev)) {
+	/* OpenGL has to be done with the texture before we can acquire it. In
+	 * pipelined mode disp doesn't wait for that, and by now it's just the
+	 * drawing of the previous frame, while its kernel may still be running.
+	 */
+	if(pipeline) {
+		glFinish();
+	}
+
+	if(!acquire_gl_object(fbuf[cur_fb], &ev)) {
 		return false;
 	}
 
 	// make sure that we will wait for the acquire to finish before running
-	prog->set_wait_event(ev);
+	first->set_wait_event(ev);
+#else
+	/* the frame in flight is read back before the next one is queued, as the
+	 * queue is in-order. The texture update below then overlaps the new frame.
+	 */
+	void *pending_pixels = 0;
+	if(pipeline && pending_fb != -1) {
+		if(!(pending_pixels = map_mem_buffer(fbuf[pending_fb], MAP_RD))) {
+			return false;
+		}
+	}
 #endif
 
-	if(!prog->run(1, global_size)) {
-		return false;
+	if(wavefront) {
+		if(!run_wavefront()) {
+			return false;
+		}
+	} else if(persistent) {
+		if(!run_persistent()) {
+			return false;
+		}
+	} else {
+		if(!run_tiled(rprog)) {
+			return false;
+		}
 	}
 
 #ifdef CLGL_INTEROP
-	if(!release_gl_object(texbuf, &ev)) {
+	if(!release_gl_object(fbuf[cur_fb], &ev)) {
 		return false;
 	}
-	clWaitForEvents(1, &ev);
-#endif
 
-#ifndef CLGL_INTEROP
-	/* if we don't compile in CL/GL interoperability support, we need
-	 * to copy the output buffer to the OpenGL texture used to displaying
-	 * the image.
-	 */
-	CLMemBuffer *mbuf = prog->get_arg_buffer(KARG_FRAMEBUFFER);
-	void *fb = map_mem_buffer(mbuf, MAP_RD);
-	if(!fb) {
-		fprintf(stderr, "FAILED\n");
-		return false;
+	if(pipeline) {
+		flush_opencl();
+
+		// show the previous frame, this one is presented by the next call
+		if(!present_frame(pending_fb)) {
+			clReleaseEvent(ev);
+			return false;
+		}
+		pending_fb = cur_fb;
+		pending_ev = ev;
+		cur_fb = (cur_fb + 1) & 1;
+	} else {
+		clWaitForEvents(1, &ev);
+		clReleaseEvent(ev);
+		glBindTexture(GL_TEXTURE_2D, fbtex[cur_fb]);
 	}
+#else
+	if(pipeline) {
+		flush_opencl();
 
-	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, rinf.xsz, rinf.ysz, GL_RGBA, GL_FLOAT, fb);
-	unmap_mem_buffer(mbuf);
+		if(pending_pixels) {
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, rinf.xsz, rinf.ysz, GL_RGBA, GL_FLOAT, pending_pixels);
+			unmap_mem_buffer(fbuf[pending_fb]);
+		}
+		pending_fb = cur_fb;
+		cur_fb = (cur_fb + 1) & 1;
+	} else {
+		/* if we don't compile in CL/GL interoperability support, we need
+		 * to copy the output buffer to the OpenGL texture used to displaying
+		 * the image.
+		 */
+		if(!present_frame(cur_fb)) {
+			return false;
+		}
+	}
 #endif
 
-	finish_opencl();
+	if(!pipeline) {
+		finish_opencl();
+	}
 
 	rstat.render_time = get_msec() - tm0;
-	printf("FOO: %ld msec\n", rstat.render_time);
+
+	/* in pipelined mode this only takes the commands which are already done,
+	 * mostly those of the previous frame, so as not to wait for this one.
+	 */
+	collect_profile(!pipeline);
 
 	timing_sample_sum += rstat.render_time;
 	num_timing_samples++;
@@ -193,22 +497,64 @@ bool render()
 	return true;
 }
 
+bool finish_render()
+{
+	if(pending_fb == -1) {
+		return true;
+	}
+
+	int idx = pending_fb;
+	pending_fb = -1;
+	return present_frame(idx);
+}
+
 
+/* the camera position is the translation of the matrix, and its basis the
+ * columns of the inverse transpose, which is what the ray directions used to
+ * be transformed by.
+ */
 void set_xform(float *matrix, float *invtrans)
 {
-	CLMemBuffer *mbuf_xform = prog->get_arg_buffer(KARG_XFORM);
-	CLMemBuffer *mbuf_invtrans = prog->get_arg_buffer(KARG_INVTRANS_XFORM);
-	assert(mbuf_xform && mbuf_invtrans);
+	for(int i=0; i<3; i++) {
+		cam.pos[i] = matrix[12 + i];
+		cam.right[i] = invtrans[i];
+		cam.up[i] = invtrans[4 + i];
+		cam.back[i] = invtrans[8 + i];
+	}
+	update_camera();
+}
 
-	float *mem = (float*)map_mem_buffer(mbuf_xform, MAP_WR);
-	memcpy(mem, matrix, 16 * sizeof *mem);
-	unmap_mem_buffer(mbuf_xform);
 
-	mem = (float*)map_mem_buffer(mbuf_invtrans, MAP_WR);
-	memcpy(mem, invtrans, 16 * sizeof *mem);
-	unmap_mem_buffer(mbuf_invtrans);
-}
+static void collect_profile(bool wait)
+{
+	frame_prof.clear();
+	if(!get_profile(&frame_prof, wait)) {
+		return;
+	}
 
+	double first = frame_prof[0].queued, last = frame_prof[0].end;
+	for(size_t i=0; i<frame_prof.size(); i++) {
+		ProfRecord *rec = &frame_prof[i];
+		float dur = rec->end - rec->start;
+
+		switch(rec->type) {
+		case PROF_KERNEL:
+			rstat.kernel_time += dur;
+			break;
+		case PROF_GL:
+			rstat.gl_sync_time += dur;
+			break;
+		default:
+			rstat.transfer_time += dur;
+		}
+		rstat.queue_wait_time += rec->start - rec->queued;
+
+		first = MIN(first, rec->queued);
+		last = MAX(last, rec->end);
+	}
+	rstat.device_time = last - first;
+	rstat.num_commands = frame_prof.size();
+}
 
 const RendInfo *get_render_info()
 {
@@ -226,6 +572,14 @@ void print_render_stats(FILE *fp)
 	fprintf(fp, "> timing\n");
 	fprintf(fp, "   render time (msec): %lu\n", rstat.render_time);
 	fprintf(fp, "   tex update time (msec): %lu\n", rstat.tex_update_time);
+	if(rstat.num_commands) {
+		fprintf(fp, "> device timing (msec, %d commands)\n", rstat.num_commands);
+		fprintf(fp, "   first queued to last done: %.3f\n", rstat.device_time);
+		fprintf(fp, "   kernels: %.3f\n", rstat.kernel_time);
+		fprintf(fp, "   transfers: %.3f\n", rstat.transfer_time);
+		fprintf(fp, "   gl sync: %.3f\n", rstat.gl_sync_time);
+		fprintf(fp, "   waiting in the queue: %.3f\n", rstat.queue_wait_time);
+	}
 	fprintf(fp, "> counters\n");
 	fprintf(fp, "   AABB tests: %d\n", rstat.aabb_tests);
 	fprintf(fp, "   AABB tests per ray (min/max/avg): %d/%d/%f\n",
@@ -240,6 +594,20 @@ void print_render_stats(FILE *fp)
 	fputc('\n', fp);
 }
 
+void print_frame_profile(FILE *fp)
+{
+	static const char *typestr[] = {"kernel", "write", "read", "map", "copy", "gl"};
+
+	fprintf(fp, "-- frame profile (msec) --\n");
+	fprintf(fp, "%-6s %-24s %9s %9s %9s %9s %9s\n", "type", "command", "queued", "submit", "start", "end", "duration");
+	for(size_t i=0; i<frame_prof.size(); i++) {
+		const ProfRecord *rec = &frame_prof[i];
+		fprintf(fp, "%-6s %-24s %9.3f %9.3f %9.3f %9.3f %9.3f\n", typestr[rec->type], rec->name.c_str(),
+				rec->queued, rec->submit, rec->start, rec->end, rec->end - rec->start);
+	}
+	fputc('\n', fp);
+}
+
 void set_render_option(int opt, bool val)
 {
 	switch(opt) {
@@ -252,6 +620,39 @@ void set_render_option(int opt, bool val)
 		rinf.cast_shadows = val;
 		break;
 
+	case ROPT_WAVEFRONT:
+		wavefront = val;
+		return;
+
+	case ROPT_PERSISTENT:
+		persistent = val;
+		return;
+
+	case ROPT_KDTREE_BUFFER:
+		kdtree_buffer = val;
+		return;
+
+	case ROPT_KDTREE_ROPES:
+		kdtree_ropes = val;
+		return;
+
+	case ROPT_SPECIALIZE:
+		specialize = val;
+		return;
+
+	case ROPT_TUNE_TILES:
+		tune_tiles = val;
+		tiles_tuned = false;
+		return;
+
+	case ROPT_PIPELINE:
+		pipeline = val;
+		return;
+
+	case ROPT_SCENE_ARENA:
+		scene_arena = val;
+		return;
+
 	default:
 		return;
 	}
@@ -274,6 +675,43 @@ void set_render_option(int opt, int val)
 		rinf.max_iter = val ? saved_iter_val : 0;
 		break;
 
+	case ROPT_WAVEFRONT:
+		wavefront = val != 0;
+		return;
+
+	case ROPT_PERSISTENT:
+		persistent = val != 0;
+		return;
+
+	case ROPT_BATCH_SIZE:
+		batch_size = MAX(val, 1);
+		return;
+
+	case ROPT_KDTREE_BUFFER:
+		kdtree_buffer = val != 0;
+		return;
+
+	case ROPT_KDTREE_ROPES:
+		kdtree_ropes = val != 0;
+		return;
+
+	case ROPT_SPECIALIZE:
+		specialize = val != 0;
+		return;
+
+	case ROPT_TUNE_TILES:
+		tune_tiles = val != 0;
+		tiles_tuned = false;
+		return;
+
+	case ROPT_PIPELINE:
+		pipeline = val != 0;
+		return;
+
+	case ROPT_SCENE_ARENA:
+		scene_arena = val != 0;
+		return;
+
 	default:
 		return;
 	}
@@ -283,6 +721,12 @@ void set_render_option(int opt, int val)
 
 void set_render_option(int opt, float val)
 {
+	if(opt == ROPT_FOV) {
+		vfov_deg = val;
+		cam.vfov = M_PI * vfov_deg / 180.0;
+		update_camera();
+		return;
+	}
 	set_render_option(opt, (int)val);
 }
 
@@ -295,6 +739,22 @@ bool get_render_option_bool(int opt)
 		return rinf.cast_shadows;
 	case ROPT_REFL:
 		return rinf.max_iter == saved_iter_val;
+	case ROPT_WAVEFRONT:
+		return wavefront;
+	case ROPT_PERSISTENT:
+		return persistent;
+	case ROPT_KDTREE_BUFFER:
+		return kdtree_buffer;
+	case ROPT_KDTREE_ROPES:
+		return kdtree_ropes;
+	case ROPT_SPECIALIZE:
+		return specialize;
+	case ROPT_TUNE_TILES:
+		return tune_tiles;
+	case ROPT_PIPELINE:
+		return pipeline;
+	case ROPT_SCENE_ARENA:
+		return scene_arena;
 	default:
 		break;
 	}
@@ -310,6 +770,24 @@ int get_render_option_int(int opt)
 		return rinf.cast_shadows ? 1 : 0;
 	case ROPT_REFL:
 		return rinf.max_iter == saved_iter_val ? 1 : 0;
+	case ROPT_WAVEFRONT:
+		return wavefront ? 1 : 0;
+	case ROPT_PERSISTENT:
+		return persistent ? 1 : 0;
+	case ROPT_BATCH_SIZE:
+		return batch_size;
+	case ROPT_KDTREE_BUFFER:
+		return kdtree_buffer ? 1 : 0;
+	case ROPT_KDTREE_ROPES:
+		return kdtree_ropes ? 1 : 0;
+	case ROPT_SPECIALIZE:
+		return specialize ? 1 : 0;
+	case ROPT_TUNE_TILES:
+		return tune_tiles ? 1 : 0;
+	case ROPT_PIPELINE:
+		return pipeline ? 1 : 0;
+	case ROPT_SCENE_ARENA:
+		return scene_arena ? 1 : 0;
 	default:
 		break;
 	}
@@ -318,6 +796,9 @@ int get_render_option_int(int opt)
 
 float get_render_option_float(int opt)
 {
+	if(opt == ROPT_FOV) {
+		return vfov_deg;
+	}
 	return (float)get_render_option_int(opt);
 }
 
@@ -335,7 +816,411 @@ static void update_render_info()
 	unmap_mem_buffer(mbuf);
 }
 
-static Ray get_primary_ray(int x, int y, int w, int h, float vfov_deg)
+static void update_camera()
+{
+	if(!prog) {
+		return;
+	}
+
+	CLMemBuffer *mbuf = prog->get_arg_buffer(KARG_CAMERA);
+	assert(mbuf);
+
+	/* mapping would wait for the frame in flight to finish. Each framebuffer
+	 * gets its own copy to write from instead, which isn't touched again until
+	 * the frame which last used it is done.
+	 */
+	if(pipeline) {
+		static Camera cam_copy[2];
+		cam_copy[cur_fb] = cam;
+		write_mem_buffer_async(mbuf, sizeof cam, cam_copy + cur_fb);
+		return;
+	}
+
+	Camera *cam_ptr = (Camera*)map_mem_buffer(mbuf, MAP_WR);
+	*cam_ptr = cam;
+	unmap_mem_buffer(mbuf);
+}
+
+/* creates the wavefront kernels. They share the scene buffers and the
+ * framebuffer of the render kernel, while the queues are created by wf_shade
+ * and shared with the rest.
+ */
+static bool init_wavefront()
+{
+	static const char *knames[] = {"wf_generate", "wf_extend", "wf_shade", "wf_shadow", "wf_output"};
+
+	for(int i=0; i<NUM_WF_KERNELS; i++) {
+		wfprog[i] = new CLProgram(knames[i]);
+		if(!load_program(wfprog[i])) {
+			destroy_wavefront();
+			return false;
+		}
+	}
+
+	size_t qsize = rinf.xsz * rinf.ysz;
+	CLProgram *shade = wfprog[WF_SHADE];
+
+	bool res = shade->set_arg_buffer(WFARG_RAYS, ARG_RDWR, 2 * qsize * WF_RAY_ITEM_SIZE) &&
+		shade->set_arg_buffer(WFARG_HITS, ARG_RDWR, qsize * WF_HIT_SIZE) &&
+		shade->set_arg_buffer(WFARG_PATHS, ARG_RDWR, qsize * WF_PATH_SIZE) &&
+		shade->set_arg_buffer(WFARG_SHADOWS, ARG_RDWR, qsize * WF_SHADOW_ITEM_SIZE) &&
+		shade->set_arg_buffer(WFARG_COUNTS, ARG_RDWR, 4 * sizeof(int));
+
+	for(int i=WF_EXTEND; i<=WF_SHADOW && res; i++) {
+		CLProgram *p = wfprog[i];
+
+		res = p->set_arg_shared(WFARG_RENDER_INFO, prog->get_arg_buffer(KARG_RENDER_INFO)) &&
+			p->set_arg_shared(WFARG_FACES, prog->get_arg_buffer(KARG_FACES)) &&
+			p->set_arg_shared(WFARG_TRIS, prog->get_arg_buffer(KARG_TRIS)) &&
+			p->set_arg_shared(WFARG_MATLIB, prog->get_arg_buffer(KARG_MATLIB)) &&
+			p->set_arg_shared(WFARG_LIGHTS, prog->get_arg_buffer(KARG_LIGHTS)) &&
+			p->set_arg_shared(WFARG_KDTREE, prog->get_arg_buffer(KARG_KDTREE)) &&
+			p->set_arg_shared(WFARG_KDLEAVES, prog->get_arg_buffer(KARG_KDLEAVES)) &&
+			p->set_arg_shared(WFARG_KDROPES, prog->get_arg_buffer(KARG_KDROPES));
+
+		if(res && p != shade) {
+			for(int j=WFARG_RAYS; j<=WFARG_COUNTS && res; j++) {
+				res = p->set_arg_shared(j, shade->get_arg_buffer(j));
+			}
+		}
+		p->set_argi(WFARG_QUEUE, 0);
+		p->set_argi(WFARG_ITER, 0);
+	}
+
+	if(res) {
+		CLProgram *gen = wfprog[WF_GENERATE];
+		res = gen->set_arg_shared(WFGEN_RENDER_INFO, prog->get_arg_buffer(KARG_RENDER_INFO)) &&
+			gen->set_arg_shared(WFGEN_CAMERA, prog->get_arg_buffer(KARG_CAMERA)) &&
+			gen->set_arg_shared(WFGEN_RAYS, shade->get_arg_buffer(WFARG_RAYS)) &&
+			gen->set_arg_shared(WFGEN_PATHS, shade->get_arg_buffer(WFARG_PATHS)) &&
+			gen->set_arg_shared(WFGEN_COUNTS, shade->get_arg_buffer(WFARG_COUNTS));
+	}
+
+	if(res) {
+		CLProgram *out = wfprog[WF_OUTPUT];
+		res = out->set_arg_shared(WFOUT_FRAMEBUFFER, prog->get_arg_buffer(KARG_FRAMEBUFFER)) &&
+			out->set_arg_shared(WFOUT_RENDER_INFO, prog->get_arg_buffer(KARG_RENDER_INFO)) &&
+			out->set_arg_shared(WFOUT_PATHS, shade->get_arg_buffer(WFARG_PATHS));
+	}
+
+	for(int i=0; i<NUM_WF_KERNELS && res; i++) {
+		res = wfprog[i]->build(build_opt);
+	}
+
+	if(!res) {
+		destroy_wavefront();
+		return false;
+	}
+	return true;
+}
+
+static void destroy_wavefront()
+{
+	for(int i=0; i<NUM_WF_KERNELS; i++) {
+		delete wfprog[i];
+		wfprog[i] = 0;
+	}
+}
+
+/* one bounce per iteration, the ray queues swap places after each one. There
+ * is no way to tell how many rays are left without reading the counters back,
+ * so all the bounces are enqueued; stages with an empty queue are cheap.
+ */
+static bool run_wavefront()
+{
+	if(!wfprog[WF_GENERATE]->run(1, global_size)) {
+		return false;
+	}
+
+	for(int i=0; i<=rinf.max_iter; i++) {
+		for(int j=WF_EXTEND; j<=WF_SHADOW; j++) {
+			if(j == WF_SHADOW && !rinf.cast_shadows) {
+				continue;
+			}
+
+			wfprog[j]->set_argi(WFARG_QUEUE, i & 1);
+			wfprog[j]->set_argi(WFARG_ITER, i);
+			if(!wfprog[j]->run(1, global_size)) {
+				return false;
+			}
+		}
+	}
+
+	return wfprog[WF_OUTPUT]->run(1, global_size);
+}
+
+/* the persistent kernel takes all the arguments of render from it, plus its
+ * own work counter.
+ */
+static bool init_persistent()
+{
+	if(!(pprog = create_shared_program("render_persistent"))) {
+		return false;
+	}
+
+	if(!pprog->set_arg_buffer(KARG_WORK_COUNTER, ARG_RDWR, sizeof(int))) {
+		goto fail;
+	}
+	pprog->set_argi(KARG_BATCH_SIZE, batch_size);
+
+	if(!pprog->build(build_opt)) {
+		goto fail;
+	}
+	return true;
+
+fail:
+	delete pprog;
+	pprog = 0;
+	return false;
+}
+
+static bool load_program(CLProgram *p)
+{
+#ifdef EMBED_KERNELS
+	return p->load_source(rt_cl_src, "rt.cl");
+#else
+	return p->load("src/rt.cl");
+#endif
+}
+
+/* loads a kernel of rt.cl which takes the arguments of render, and binds them
+ * to the buffers of the main program. It still has to be built.
+ */
+static CLProgram *create_shared_program(const char *kname)
+{
+	CLProgram *p = new CLProgram(kname);
+	if(!load_program(p)) {
+		delete p;
+		return 0;
+	}
+
+	for(int i=0; i<NUM_KERNEL_ARGS; i++) {
+		if(!p->set_arg_shared(i, prog->get_arg_buffer(i))) {
+			delete p;
+			return 0;
+		}
+	}
+	return p;
+}
+
+/* returns the render kernel built for the current number of lights, bounces
+ * and shadow setting, building it the first time these are used. Toggling an
+ * option back and forth switches between programs which are already built.
+ */
+static CLProgram *get_spec_program()
+{
+	char opt[512];
+	sprintf(opt, "%s -DSPEC_NUM_LIGHTS=%d -DSPEC_MAX_ITER=%d -DSPEC_CAST_SHADOWS=%d", build_opt,
+			rinf.num_lights, rinf.max_iter, rinf.cast_shadows ? 1 : 0);
+
+	std::map<std::string, CLProgram*>::iterator it = spec_progs.find(opt);
+	if(it != spec_progs.end()) {
+		return it->second;
+	}
+
+	printf("building specialized render kernel:%s\n", opt + strlen(build_opt));
+
+	CLProgram *p = create_shared_program("render");
+	if(p && !p->build(opt)) {
+		delete p;
+		p = 0;
+	}
+	spec_progs[opt] = p;	// don't retry the failed ones every frame
+	return p;
+}
+
+/* runs the render kernel over the framebuffer in 2D tiles, so that the
+ * work-items of a group trace neighbouring pixels. The tile shape is tuned
+ * the first time (see CLProgram::tune_local_size), and the range rounded up to
+ * whole tiles; the kernel skips the work-items past the edges.
+ */
+static bool run_tiled(CLProgram *p)
+{
+	if(!tiles_tuned) {
+		if(!tune_tiles || !p->tune_local_size(rinf.xsz, rinf.ysz, tile_size)) {
+			tile_size[0] = tile_size[1] = 0;
+		}
+		tiles_tuned = true;
+	}
+
+	size_t gsize[2];
+	gsize[0] = rinf.xsz;
+	gsize[1] = rinf.ysz;
+
+	if(get_num_devices() > 1) {
+		return run_split(p, gsize);
+	}
+
+	// the tiles were tuned with one variant of the kernel, another might not fit them
+	if(!tile_size[0] || (int)(tile_size[0] * tile_size[1]) > p->get_work_group_size()) {
+		return p->run_ndrange(2, gsize);
+	}
+
+	for(int i=0; i<2; i++) {
+		gsize[i] = (gsize[i] + tile_size[i] - 1) / tile_size[i] * tile_size[i];
+	}
+	return p->run_ndrange(2, gsize, tile_size);
+}
+
+/* with multiple devices each one renders a band of the frame, sized by how
+ * fast it went through its band last time. The split only adapts gradually,
+ * so that one slow frame doesn't make it swing back and forth.
+ */
+static bool run_split(CLProgram *p, const size_t *gsize)
+{
+	int ndev = get_num_devices();
+	int rows[MAX_DEVICES];
+	double msec[MAX_DEVICES];
+
+	if(!dev_share[0]) {
+		for(int i=0; i<ndev; i++) {
+			dev_share[i] = 1.0 / ndev;
+		}
+	}
+
+	if(p->get_band_times(rows, msec)) {
+		float rate[MAX_DEVICES], rate_sum = 0.0;
+
+		for(int i=0; i<ndev; i++) {
+			rate[i] = rows[i] && msec[i] > 0.0 ? rows[i] / msec[i] : 0.0;
+			rate_sum += rate[i];
+		}
+		if(rate_sum > 0.0) {
+			for(int i=0; i<ndev; i++) {
+				// a device without a time keeps its share until it has one
+				if(rate[i] > 0.0) {
+					dev_share[i] = 0.5 * dev_share[i] + 0.5 * rate[i] / rate_sum;
+				}
+			}
+		}
+	}
+
+	/* bands are whole rows of tiles, and every device gets at least one, so
+	 * that we keep measuring it.
+	 */
+	int step = tile_size[1] ? (int)tile_size[1] : 1;
+	int num_steps = (gsize[1] + step - 1) / step;
+	if(num_steps < ndev) {
+		return p->run_ndrange(2, gsize, tile_size[0] ? tile_size : 0);
+	}
+
+	float share_sum = 0.0;
+	for(int i=0; i<ndev; i++) {
+		share_sum += dev_share[i];
+	}
+
+	int start = 0;
+	float cum = 0.0;
+	for(int i=0; i<ndev; i++) {
+		cum += dev_share[i];
+		int end = i == ndev - 1 ? num_steps : (int)(cum / share_sum * num_steps + 0.5);
+		end = MAX(end, start + 1);
+		end = MIN(end, num_steps - (ndev - i - 1));
+		rows[i] = (end - start) * step;
+		start = end;
+	}
+
+	return p->run_bands(KARG_FRAMEBUFFER, gsize, tile_size[0] ? tile_size : 0, rows);
+}
+
+static bool init_pipeline()
+{
+#ifdef CLGL_INTEROP
+	glGenTextures(1, fbtex + 1);
+	glBindTexture(GL_TEXTURE_2D, fbtex[1]);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F_ARB, rinf.xsz, rinf.ysz, 0, GL_RGBA, GL_FLOAT, 0);
+	glBindTexture(GL_TEXTURE_2D, fbtex[pending_fb == -1 ? cur_fb : pending_fb]);
+
+	if(!(fbuf[1] = create_image_buffer(ARG_WR, fbtex[1]))) {
+		glDeleteTextures(1, fbtex + 1);
+		fbtex[1] = 0;
+		return false;
+	}
+#else
+	if(!(fbuf[1] = create_image_buffer(ARG_WR, rinf.xsz, rinf.ysz))) {
+		return false;
+	}
+#endif
+	return true;
+}
+
+// points every kernel which writes the framebuffer to fbuf[idx]
+static bool bind_framebuffer(int idx)
+{
+	if(idx == bound_fb) {
+		return true;
+	}
+	CLMemBuffer *fb = fbuf[idx];
+
+	if(!prog->set_arg_shared(KARG_FRAMEBUFFER, fb)) {
+		return false;
+	}
+	std::map<std::string, CLProgram*>::iterator it = spec_progs.begin();
+	while(it != spec_progs.end()) {
+		if(it->second && !it->second->set_arg_shared(KARG_FRAMEBUFFER, fb)) {
+			return false;
+		}
+		it++;
+	}
+	if(pprog && !pprog->set_arg_shared(KARG_FRAMEBUFFER, fb)) {
+		return false;
+	}
+	if(wfprog[WF_OUTPUT] && !wfprog[WF_OUTPUT]->set_arg_shared(WFOUT_FRAMEBUFFER, fb)) {
+		return false;
+	}
+	bound_fb = idx;
+	return true;
+}
+
+// waits for the frame in fbuf[idx] to finish and makes it the displayed image
+static bool present_frame(int idx)
+{
+	if(idx == -1) {
+		return true;
+	}
+
+#ifdef CLGL_INTEROP
+	if(pending_ev) {
+		clWaitForEvents(1, &pending_ev);
+		clReleaseEvent(pending_ev);
+		pending_ev = 0;
+	}
+	glBindTexture(GL_TEXTURE_2D, fbtex[idx]);
+#else
+	void *fb = map_mem_buffer(fbuf[idx], MAP_RD);
+	if(!fb) {
+		fprintf(stderr, "FAILED\n");
+		return false;
+	}
+
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, rinf.xsz, rinf.ysz, GL_RGBA, GL_FLOAT, fb);
+	unmap_mem_buffer(fbuf[idx]);
+#endif
+	return true;
+}
+
+/* one work-group per compute unit, as large as the kernel allows, is enough
+ * to keep the device busy; the groups then take pixels off the counter until
+ * there are none left.
+ */
+static bool run_persistent()
+{
+	static const int zero = 0;
+	if(!write_mem_buffer(pprog->get_arg_buffer(KARG_WORK_COUNTER), sizeof zero, &zero)) {
+		return false;
+	}
+	pprog->set_argi(KARG_BATCH_SIZE, batch_size);
+
+	size_t lsize = MAX(pprog->get_work_group_size(), 1);
+	size_t gsize = MAX(get_num_compute_units(), 1) * lsize;
+	return pprog->run_ndrange(1, &gsize, &lsize);
+}
+
+Ray get_primary_ray(int x, int y, int w, int h, float vfov_deg)
 {
 	float vfov = M_PI * vfov_deg / 180.0;
 	float aspect = (float)w / (float)h;
@@ -357,43 +1242,65 @@ static Ray get_primary_ray(int x, int y, int w, int h, float vfov_deg)
 	return ray;
 }
 
-#define MIN(a, b)	((a) < (b) ? (a) : (b))
-
-static float *create_kdimage(const KDNodeGPU *kdtree, int num_nodes, int *xsz_ret, int *ysz_ret)
+/* creates the buffers of the static scene data and binds them to the render
+ * kernel, either one buffer each, or all of them packed in the scene arena.
+ */
+static bool create_scene_buffers(const int *args, const size_t *sizes, const void * const *data, int num)
 {
-	int ysz = MIN(num_nodes, KDIMG_MAX_HEIGHT);
-	int columns = (num_nodes - 1) / KDIMG_MAX_HEIGHT + 1;
-	int xsz = KDIMG_NODE_WIDTH * columns;
+	if(scene_arena) {
+		if((arena_buf = create_mem_arena(ARG_RD, num, sizes, data, arena_parts))) {
+			num_arena_parts = num;
+
+			for(int i=0; i<num; i++) {
+				if(!prog->set_arg_shared(args[i], arena_parts[i])) {
+					return false;
+				}
+			}
+			printf("scene arena: %d buffers in %lu bytes\n", num, (unsigned long)arena_buf->size);
+			return true;
+		}
+		fprintf(stderr, "failed to create the scene arena, using separate buffers\n");
+		scene_arena = false;
+	}
 
-	printf("creating kdtree image %dx%d (%d nodes)\n", xsz, ysz, num_nodes);
+	for(int i=0; i<num; i++) {
+		prog->set_arg_buffer(args[i], ARG_RD, sizes[i], data[i]);
+	}
+	return true;
+}
 
-	float *img = new float[4 * xsz * ysz];
-	memset(img, 0, 4 * xsz * ysz * sizeof *img);
+// the sub-buffers have to go before the arena they were made from
+static void destroy_scene_buffers()
+{
+	for(int i=0; i<num_arena_parts; i++) {
+		destroy_mem_buffer(arena_parts[i]);
+		arena_parts[i] = 0;
+	}
+	num_arena_parts = 0;
 
-	for(int i=0; i<num_nodes; i++) {
-		int x = KDIMG_NODE_WIDTH * (i / KDIMG_MAX_HEIGHT);
-		int y = i % KDIMG_MAX_HEIGHT;
+	destroy_mem_buffer(arena_buf);
+	arena_buf = 0;
+}
 
-		float *ptr = img + (y * xsz + x) * 4;
+/* packs the compact nodes two per RGBA32UI pixel, in rows of KDIMG_MAX_WIDTH
+ * pixels. Sibling pairs start at even indices, so each pair is a single pixel.
+ */
+static unsigned int *create_kdimage(const KDNodeGPU *kdtree, int num_nodes, int *xsz_ret, int *ysz_ret)
+{
+	int num_pixels = (num_nodes + 1) / 2;
+	int xsz = MIN(num_pixels, KDIMG_MAX_WIDTH);
+	int ysz = (num_pixels - 1) / KDIMG_MAX_WIDTH + 1;
 
-		*ptr++ = kdtree[i].aabb.min[0];
-		*ptr++ = kdtree[i].aabb.min[1];
-		*ptr++ = kdtree[i].aabb.min[2];
-		*ptr++ = 0.0;
+	printf("creating kdtree image %dx%d (%d nodes)\n", xsz, ysz, num_nodes);
 
-		*ptr++ = kdtree[i].aabb.max[0];
-		*ptr++ = kdtree[i].aabb.max[1];
-		*ptr++ = kdtree[i].aabb.max[2];
-		*ptr++ = 0.0;
+	unsigned int *img = new unsigned int[4 * xsz * ysz];
+	memset(img, 0, 4 * xsz * ysz * sizeof *img);
 
-		for(int j=0; j<MAX_NODE_FACES; j++) {
-			*ptr++ = j < kdtree[i].num_faces ? (float)kdtree[i].face_idx[j] : 0.0f;
-		}
+	for(int i=0; i<num_nodes; i++) {
+		unsigned int *ptr = img + i * 2;
 
-		*ptr++ = (float)kdtree[i].num_faces;
-		*ptr++ = (float)kdtree[i].left;
-		*ptr++ = (float)kdtree[i].right;
-		*ptr++ = 0.0;
+		memcpy(ptr, &kdtree[i].face_offset, sizeof *ptr);	// or the split position
+		ptr[1] = kdtree[i].info;
 	}
 
 	if(xsz_ret) *xsz_ret = xsz;
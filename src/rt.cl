@@ -3,24 +3,58 @@
 
 struct RendInfo {
 	float4 ambient;
+	float4 kdtree_min, kdtree_max;
 	int xsz, ysz;
 	int num_faces, num_lights;
 	int max_iter;
 	int cast_shadows;
 };
 
-struct Vertex {
-	float4 pos;
-	float4 normal;
-	float4 tex;
-	float4 padding;
+/* the render options can be fixed at compile time by defining SPEC_NUM_LIGHTS,
+ * SPEC_MAX_ITER and SPEC_CAST_SHADOWS (see get_spec_program in rt.cc), so that
+ * the compiler can unroll the loops and drop the branches which depend on them.
+ * Otherwise they're read from the render info.
+ */
+#ifdef SPEC_NUM_LIGHTS
+#define NUM_LIGHTS(scn)		SPEC_NUM_LIGHTS
+#else
+#define NUM_LIGHTS(scn)		((scn)->num_lights)
+#endif
+
+#ifdef SPEC_MAX_ITER
+#define MAX_ITER(rinf)		SPEC_MAX_ITER
+#else
+#define MAX_ITER(rinf)		((rinf)->max_iter)
+#endif
+
+#ifdef SPEC_CAST_SHADOWS
+#define CAST_SHADOWS(scn)	SPEC_CAST_SHADOWS
+#else
+#define CAST_SHADOWS(scn)	((scn)->cast_shadows)
+#endif
+
+// shading data of a face, see struct FaceShading in scene.h
+struct FaceShading {
+	float4 normal[3];
+	float2 tex[3];
+	int matid;
+	int padding;
 };
 
-struct Face {
-	struct Vertex v[3];
-	float4 normal;
-	int matid;
-	int padding[3];
+// precomputed Moller-Trumbore record of a face, see struct TriAccel in scene.h
+struct TriAccel {
+	float4 v0;
+	float4 e1, e2;
+};
+
+// leaf of the kd-tree with ropes, see struct KDLeafGPU in scene.h
+struct KDLeafGPU {
+	float min[3];
+	uint face_offset;
+	float max[3];
+	uint num_faces;
+	int rope[6];
+	int padding[2];
 };
 
 struct Material {
@@ -38,85 +72,440 @@ struct Ray {
 	float4 origin, dir;
 };
 
+/* the kd-tree nodes (see KDNodeGPU in scene.h) are read from a RGBA32UI image
+ * by default, which goes through the texture cache, or from a plain buffer if
+ * built with -DKDTREE_BUFFER, which isn't limited by the maximum image size.
+ */
+#ifdef KDTREE_BUFFER
+#define KDTREE_ARG	global const uint2 *
+#else
+#define KDTREE_ARG	read_only image2d_t
+#endif
+
+// see struct Camera in rt.h
+struct Camera {
+	float4 pos;
+	float4 right, up, back;
+	float vfov;
+	float padding[3];
+};
+
 struct SurfPoint {
 	float t;
 	float4 pos, norm, dbg;
-	global const struct Face *obj;
+	global const struct FaceShading *obj;
 	struct Material mat;
 };
 
+struct AABBox {
+	float4 min, max;
+};
+
 struct Scene {
 	float4 ambient;
-	global const struct Face *faces;
+	global const struct FaceShading *faces;
+	global const struct TriAccel *tris;
 	int num_faces;
 	global const struct Light *lights;
 	int num_lights;
 	global const struct Material *matlib;
 	//global const struct KDNode *kdtree;
+	global const int *kdleaves;
+	global const struct KDLeafGPU *kdropes;
+	struct AABBox kdtree_aabb;
 	bool cast_shadows;
 };
 
-struct AABBox {
-	float4 min, max;
+/* wavefront mode state. Rays waiting for the next bounce are kept in two
+ * queues of xsz * ysz items each (the one being traced and the one being
+ * filled), shaded points waiting for their shadow rays in a third one. The
+ * queues are compacted: each stage appends with an atomic counter, so the
+ * active items are always at the start. See wf_generate.
+ */
+struct RayItem {
+	struct Ray ray;
+	int pixel;
+	int padding[3];
 };
 
-struct KDNode {
-	struct AABBox aabb;
-	int face_idx[MAX_NODE_FACES];
-	int num_faces;
-	int left, right;
-	int padding;
+// color accumulated so far and the weight of the next bounce, per pixel
+struct PathState {
+	float4 color, energy;
+};
+
+// a shaded point, mat is premultiplied by the energy of the path
+struct ShadowItem {
+	float4 pos, norm, vref;
+	struct Material mat;
+	int pixel;
+	int padding[3];
+};
+
+// queue counters (counts argument of the wavefront kernels)
+#define WF_SHADOW_COUNT	2
+
+// nearest hit of a ray, face is -1 if it didn't hit anything
+struct Hit {
+	float t;
+	float u, v;
+	int face;
+};
+
+// kd-tree traversal stack entry, the part of the ray in [tmin, tmax] lies in the node
+struct KDStackItem {
+	int node;
+	float tmin, tmax;
+};
+
+// ray components as arrays, so that they can be indexed by the split axis
+struct KDRay {
+	float org[3], dir[3], invdir[3];
 };
 
 #define MIN_ENERGY	0.001
 
-float4 shade(struct Ray ray, struct Scene *scn, const struct SurfPoint *sp, read_only image2d_t kdimg);
-bool find_intersection(struct Ray ray, const struct Scene *scn, struct SurfPoint *sp, read_only image2d_t kdimg);
-bool intersect(struct Ray ray, global const struct Face *face, struct SurfPoint *sp);
-bool intersect_aabb(struct Ray ray, struct AABBox aabb);
+void init_scene(struct Scene *scn, global const struct RendInfo *rinf, global const struct FaceShading *faces,
+		global const struct TriAccel *tris, global const struct Material *matlib,
+		global const struct Light *lights, global const int *kdleaves,
+		global const struct KDLeafGPU *kdropes);
+float4 trace_path(struct Ray ray, struct Scene *scn, int max_iter, KDTREE_ARG kdtree);
+float4 shade(struct Ray ray, struct Scene *scn, const struct SurfPoint *sp, KDTREE_ARG kdtree);
+float4 shade_light(const struct Material *mat, float4 ldir, float4 norm, float4 vref);
+float4 facing_normal(struct Ray ray, const struct SurfPoint *sp);
+float4 view_reflect(struct Ray ray, float4 norm);
+bool find_intersection(struct Ray ray, const struct Scene *scn, struct SurfPoint *sp, KDTREE_ARG kdtree);
+bool find_nearest(struct Ray ray, const struct Scene *scn, struct Hit *hit, KDTREE_ARG kdtree);
+void get_surface(struct Ray ray, const struct Scene *scn, const struct Hit *hit, struct SurfPoint *sp);
+bool find_occlusion(struct Ray ray, const struct Scene *scn, KDTREE_ARG kdtree);
+int find_rope_leaf(int idx, float t, const struct KDRay *kdray, KDTREE_ARG kdtree);
+int leaf_exit(global const struct KDLeafGPU *leaf, const struct KDRay *kdray, float *texit);
+void init_kdray(struct KDRay *kdray, struct Ray ray);
+uint2 find_leaf(int idx, float *tmin, float *tmax, struct KDStackItem *stack, int *top,
+		const struct KDRay *kdray, KDTREE_ARG kdtree);
+bool intersect(struct Ray ray, global const struct TriAccel *tri, float *tres, float2 *uv);
+bool intersect_aabb(struct Ray ray, struct AABBox aabb, float *tnear, float *tfar);
 
 float4 reflect(float4 v, float4 n);
-float4 transform(float4 v, global const float *xform);
-void transform_ray(struct Ray *ray, global const float *xform, global const float *invtrans);
-float4 calc_bary(float4 pt, global const struct Face *face, float4 norm);
+struct Ray get_primary_ray(int x, int y, int w, int h, global const struct Camera *cam);
 float mean(float4 v);
 
-void read_kdnode(int idx, struct KDNode *node, read_only image2d_t kdimg);
+uint2 read_kdnode(int idx, KDTREE_ARG kdtree);
 
 
 kernel void render(write_only image2d_t fb,
 		global const struct RendInfo *rinf,
-		global const struct Face *faces,
+		global const struct FaceShading *faces,
+		global const struct TriAccel *tris,
+		global const struct Material *matlib,
+		global const struct Light *lights,
+		global const struct Camera *cam,
+		KDTREE_ARG kdtree,
+		global const int *kdleaves,
+		global const struct KDLeafGPU *kdropes)
+{
+	// launched over screen tiles, the range is rounded up to whole work-groups
+	int2 coord = (int2)(get_global_id(0), get_global_id(1));
+	if(coord.x >= rinf->xsz || coord.y >= rinf->ysz) {
+		return;
+	}
+
+	struct Scene scn;
+	init_scene(&scn, rinf, faces, tris, matlib, lights, kdleaves, kdropes);
+
+	struct Ray ray = get_primary_ray(coord.x, coord.y, rinf->xsz, rinf->ysz, cam);
+	float4 pixel = trace_path(ray, &scn, MAX_ITER(rinf), kdtree);
+
+	write_imagef(fb, coord, pixel);
+}
+
+/* persistent-threads variant of render: launched with just enough work-groups
+ * to fill the device once, each of them keeps fetching the next batch_size *
+ * local size pixels from the work counter until all of them are taken. The
+ * groups that got the short paths go on to the next batch instead of sitting
+ * idle until the longest reflection chain of the frame is done. The counter
+ * has to be zero before every launch.
+ */
+kernel void render_persistent(write_only image2d_t fb,
+		global const struct RendInfo *rinf,
+		global const struct FaceShading *faces,
+		global const struct TriAccel *tris,
+		global const struct Material *matlib,
+		global const struct Light *lights,
+		global const struct Camera *cam,
+		KDTREE_ARG kdtree,
+		global const int *kdleaves,
+		global const struct KDLeafGPU *kdropes,
+		global int *work,
+		int batch_size)
+{
+	local int batch_start;
+
+	int lid = get_local_id(0);
+	int lsz = get_local_size(0);
+	int num_pixels = rinf->xsz * rinf->ysz;
+
+	struct Scene scn;
+	init_scene(&scn, rinf, faces, tris, matlib, lights, kdleaves, kdropes);
+
+	for(;;) {
+		if(lid == 0) {
+			batch_start = atomic_add(work, batch_size * lsz);
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+		int start = batch_start;
+		barrier(CLK_LOCAL_MEM_FENCE);	// everyone has read it before it's overwritten
+
+		if(start >= num_pixels) {
+			break;
+		}
+
+		// adjacent work-items get adjacent pixels, which keeps their rays coherent
+		for(int i=0; i<batch_size; i++) {
+			int idx = start + i * lsz + lid;
+			if(idx >= num_pixels) {
+				break;
+			}
+
+			int2 coord;
+			coord.x = idx % rinf->xsz;
+			coord.y = idx / rinf->xsz;
+
+			struct Ray ray = get_primary_ray(coord.x, coord.y, rinf->xsz, rinf->ysz, cam);
+			float4 pixel = trace_path(ray, &scn, MAX_ITER(rinf), kdtree);
+
+			write_imagef(fb, coord, pixel);
+		}
+	}
+}
+
+/* ---- wavefront pipeline ----
+ * Alternative to the render kernel above, which follows a pixel's path
+ * through all of its bounces in a single work-item, so that the work-items
+ * of a wave diverge as soon as some of them hit a mirror and others don't.
+ * Here each bounce is split into separate kernels, each doing one thing for
+ * all the rays still alive:
+ *
+ *   wf_generate, then max_iter + 1 times: wf_extend, wf_shade, wf_shadow,
+ *   and finally wf_output.
+ *
+ * All of them are launched with xsz * ysz work-items, the ones past the end of
+ * their input queue return right away. queue selects which of the two ray
+ * queues is traced by the current bounce.
+ */
+kernel void wf_generate(global const struct RendInfo *rinf,
+		global const struct Camera *cam,
+		global struct RayItem *rays,
+		global struct PathState *paths,
+		global int *counts)
+{
+	int idx = get_global_id(0);
+
+	if(idx == 0) {
+		counts[0] = rinf->xsz * rinf->ysz;
+		counts[1] = counts[WF_SHADOW_COUNT] = 0;
+	}
+
+	int x = idx % rinf->xsz;
+	int y = idx / rinf->xsz;
+
+	rays[idx].ray = get_primary_ray(x, y, rinf->xsz, rinf->ysz, cam);
+	rays[idx].pixel = idx;
+
+	paths[idx].color = (float4)(0, 0, 0, 0);
+	paths[idx].energy = (float4)(1.0, 1.0, 1.0, 0.0);
+}
+
+// finds the nearest hit of every ray in the queue
+kernel void wf_extend(global const struct RendInfo *rinf,
+		global const struct FaceShading *faces,
+		global const struct TriAccel *tris,
+		global const struct Material *matlib,
+		global const struct Light *lights,
+		KDTREE_ARG kdtree,
+		global const int *kdleaves,
+		global const struct KDLeafGPU *kdropes,
+		global struct RayItem *rays,
+		global struct Hit *hits,
+		global struct PathState *paths,
+		global struct ShadowItem *shadows,
+		global int *counts,
+		int queue, int iter)
+{
+	int idx = get_global_id(0);
+	int qsize = rinf->xsz * rinf->ysz;
+
+	// nothing reads the queues filled by wf_shade before it runs
+	if(idx == 0) {
+		counts[1 - queue] = counts[WF_SHADOW_COUNT] = 0;
+	}
+
+	if(idx >= counts[queue]) {
+		return;
+	}
+
+	struct Scene scn;
+	init_scene(&scn, rinf, faces, tris, matlib, lights, kdleaves, kdropes);
+
+	struct Hit hit;
+	find_nearest(rays[queue * qsize + idx].ray, &scn, &hit, kdtree);
+	hits[idx] = hit;
+}
+
+/* shades the hits: adds the ambient term (and the lights when there are no
+ * shadows) to the pixel, queues the point for wf_shadow, and queues the
+ * reflected ray for the next bounce if it still carries enough energy.
+ */
+kernel void wf_shade(global const struct RendInfo *rinf,
+		global const struct FaceShading *faces,
+		global const struct TriAccel *tris,
 		global const struct Material *matlib,
 		global const struct Light *lights,
-		global const struct Ray *primrays,
-		global const float *xform,
-		global const float *invtrans,
-		//global const struct KDNode *kdtree
-		read_only image2d_t kdtree_img)
+		KDTREE_ARG kdtree,
+		global const int *kdleaves,
+		global const struct KDLeafGPU *kdropes,
+		global struct RayItem *rays,
+		global struct Hit *hits,
+		global struct PathState *paths,
+		global struct ShadowItem *shadows,
+		global int *counts,
+		int queue, int iter)
 {
 	int idx = get_global_id(0);
+	int qsize = rinf->xsz * rinf->ysz;
+
+	if(idx >= counts[queue] || hits[idx].face < 0) {
+		return;
+	}
 
 	struct Scene scn;
-	scn.ambient = rinf->ambient;
-	scn.faces = faces;
-	scn.num_faces = rinf->num_faces;
-	scn.lights = lights;
-	scn.num_lights = rinf->num_lights;
-	scn.matlib = matlib;
-	scn.cast_shadows = rinf->cast_shadows;
+	init_scene(&scn, rinf, faces, tris, matlib, lights, kdleaves, kdropes);
+
+	struct RayItem item = rays[queue * qsize + idx];
+	struct Hit hit = hits[idx];
+	struct SurfPoint sp;
+	get_surface(item.ray, &scn, &hit, &sp);
+
+	float4 energy = paths[item.pixel].energy;
+	float4 norm = facing_normal(item.ray, &sp);
+	float4 vref = view_reflect(item.ray, norm);
+
+	float4 col = scn.ambient * sp.mat.kd;
+
+	if(scn.cast_shadows) {
+		if(scn.num_lights > 0) {
+			int slot = atomic_inc(counts + WF_SHADOW_COUNT);
+
+			shadows[slot].pos = sp.pos;
+			shadows[slot].norm = norm;
+			shadows[slot].vref = vref;
+			shadows[slot].mat = sp.mat;
+			shadows[slot].mat.kd *= energy;
+			shadows[slot].mat.ks *= energy;
+			shadows[slot].pixel = item.pixel;
+		}
+	} else {
+		for(int i=0; i<scn.num_lights; i++) {
+			col += shade_light(&sp.mat, scn.lights[i].pos - sp.pos, norm, vref);
+		}
+	}
+	paths[item.pixel].color += col * energy;
+
+	energy *= sp.mat.ks * sp.mat.kr;
+
+	if(iter < rinf->max_iter && mean(energy) > MIN_ENERGY) {
+		int slot = atomic_inc(counts + 1 - queue);
+
+		item.ray.origin = sp.pos;
+		item.ray.dir = reflect(-item.ray.dir, sp.norm);
+		rays[(1 - queue) * qsize + slot] = item;
+
+		paths[item.pixel].energy = energy;
+	}
+}
+
+// casts the shadow rays of the shaded points, and adds the lights they see
+kernel void wf_shadow(global const struct RendInfo *rinf,
+		global const struct FaceShading *faces,
+		global const struct TriAccel *tris,
+		global const struct Material *matlib,
+		global const struct Light *lights,
+		KDTREE_ARG kdtree,
+		global const int *kdleaves,
+		global const struct KDLeafGPU *kdropes,
+		global struct RayItem *rays,
+		global struct Hit *hits,
+		global struct PathState *paths,
+		global struct ShadowItem *shadows,
+		global int *counts,
+		int queue, int iter)
+{
+	int idx = get_global_id(0);
+
+	if(idx >= counts[WF_SHADOW_COUNT]) {
+		return;
+	}
+
+	struct Scene scn;
+	init_scene(&scn, rinf, faces, tris, matlib, lights, kdleaves, kdropes);
+
+	struct ShadowItem item = shadows[idx];
+	float4 col = (float4)(0, 0, 0, 0);
+
+	for(int i=0; i<scn.num_lights; i++) {
+		struct Ray shadowray;
+		shadowray.origin = item.pos;
+		shadowray.dir = scn.lights[i].pos - item.pos;
+
+		if(!find_occlusion(shadowray, &scn, kdtree)) {
+			col += shade_light(&item.mat, shadowray.dir, item.norm, item.vref);
+		}
+	}
+	paths[item.pixel].color += col;
+}
+
+kernel void wf_output(write_only image2d_t fb,
+		global const struct RendInfo *rinf,
+		global const struct PathState *paths)
+{
+	int idx = get_global_id(0);
+
+	int2 coord;
+	coord.x = idx % rinf->xsz;
+	coord.y = idx / rinf->xsz;
+
+	write_imagef(fb, coord, paths[idx].color);
+}
 
-	struct Ray ray = primrays[idx];
-	transform_ray(&ray, xform, invtrans);
+void init_scene(struct Scene *scn, global const struct RendInfo *rinf, global const struct FaceShading *faces,
+		global const struct TriAccel *tris, global const struct Material *matlib,
+		global const struct Light *lights, global const int *kdleaves,
+		global const struct KDLeafGPU *kdropes)
+{
+	scn->ambient = rinf->ambient;
+	scn->faces = faces;
+	scn->tris = tris;
+	scn->num_faces = rinf->num_faces;
+	scn->lights = lights;
+	scn->num_lights = rinf->num_lights;
+	scn->matlib = matlib;
+	scn->kdleaves = kdleaves;
+	scn->kdropes = kdropes;
+	scn->kdtree_aabb.min = rinf->kdtree_min;
+	scn->kdtree_aabb.max = rinf->kdtree_max;
+	scn->cast_shadows = rinf->cast_shadows;
+}
 
+// follows the path of a ray through up to max_iter reflections
+float4 trace_path(struct Ray ray, struct Scene *scn, int max_iter, KDTREE_ARG kdtree)
+{
 	float4 pixel = (float4)(0, 0, 0, 0);
 	float4 energy = (float4)(1.0, 1.0, 1.0, 0.0);
 	int iter = 0;
 
-	while(iter++ <= rinf->max_iter && mean(energy) > MIN_ENERGY) {
+	while(iter++ <= max_iter && mean(energy) > MIN_ENERGY) {
 		struct SurfPoint sp;
-		if(find_intersection(ray, &scn, &sp, kdtree_img)) {
-			pixel += shade(ray, &scn, &sp, kdtree_img) * energy;
+		if(find_intersection(ray, scn, &sp, kdtree)) {
+			pixel += shade(ray, scn, &sp, kdtree) * energy;
 
 			float4 refl_col = sp.mat.ks * sp.mat.kr;
 
@@ -128,232 +517,455 @@ kernel void render(write_only image2d_t fb,
 			energy = (float4)(0.0, 0.0, 0.0, 0.0);
 		}
 	}
-
-	int2 coord;
-	coord.x = idx % rinf->xsz;
-	coord.y = idx / rinf->xsz;
-
-	write_imagef(fb, coord, pixel);
+	return pixel;
 }
 
-float4 shade(struct Ray ray, struct Scene *scn, const struct SurfPoint *sp, read_only image2d_t kdimg)
+float4 shade(struct Ray ray, struct Scene *scn, const struct SurfPoint *sp, KDTREE_ARG kdtree)
 {
-	float4 norm = sp->norm;
-	//bool entering = true;
+	float4 norm = facing_normal(ray, sp);
+	float4 vref = view_reflect(ray, norm);
 
-	if(dot(ray.dir, norm) >= 0.0) {
-		norm = -norm;
-		//entering = false;
-	}
-
-	float4 dcol = scn->ambient * sp->mat.kd;
-	float4 scol = (float4)(0, 0, 0, 0);
+	float4 col = scn->ambient * sp->mat.kd;
 
-	for(int i=0; i<scn->num_lights; i++) {
+	for(int i=0; i<NUM_LIGHTS(scn); i++) {
 		float4 ldir = scn->lights[i].pos - sp->pos;
 
 		struct Ray shadowray;
 		shadowray.origin = sp->pos;
 		shadowray.dir = ldir;
 
-		if(!scn->cast_shadows || !find_intersection(shadowray, scn, 0, kdimg)) {
-			ldir = normalize(ldir);
-			float4 vdir = -ray.dir;
-			vdir.x = native_divide(vdir.x, RAY_MAG);
-			vdir.y = native_divide(vdir.y, RAY_MAG);
-			vdir.z = native_divide(vdir.z, RAY_MAG);
-			float4 vref = reflect(vdir, norm);
-
-			float diff = fmax(dot(ldir, norm), 0.0f);
-			dcol += sp->mat.kd /* scn->lights[i].color*/ * diff;
-
-			float spec = native_powr(fmax(dot(ldir, vref), 0.0f), sp->mat.spow);
-			scol += sp->mat.ks /* scn->lights[i].color*/ * spec;
+		if(!CAST_SHADOWS(scn) || !find_occlusion(shadowray, scn, kdtree)) {
+			col += shade_light(&sp->mat, ldir, norm, vref);
 		}
 	}
+	return col;
+}
+
+// diffuse and specular contribution of an unoccluded light in direction ldir
+float4 shade_light(const struct Material *mat, float4 ldir, float4 norm, float4 vref)
+{
+	ldir = normalize(ldir);
 
-	return dcol + scol;
+	float diff = fmax(dot(ldir, norm), 0.0f);
+	float spec = native_powr(fmax(dot(ldir, vref), 0.0f), mat->spow);
+
+	return mat->kd /* light color */ * diff + mat->ks /* light color */ * spec;
 }
 
-#define STACK_SIZE	MAX_TREE_DEPTH
-bool find_intersection(struct Ray ray, const struct Scene *scn, struct SurfPoint *spres, read_only image2d_t kdimg)
+// the surface normal flipped to face the incoming ray
+float4 facing_normal(struct Ray ray, const struct SurfPoint *sp)
 {
-	struct SurfPoint sp0;
-	sp0.t = 1.0;
-	sp0.obj = 0;
-
-	int idxstack[STACK_SIZE];
-	int top = 0;			// points after the topmost element of the stack
-	idxstack[top++] = 0;	// root at tree[0]
-
-	while(top > 0) {
-		int idx = idxstack[--top];	// remove this index from the stack and process it
-
-		struct KDNode node;
-		read_kdnode(idx, &node, kdimg);
-
-		if(intersect_aabb(ray, node.aabb)) {
-			if(node.left == -1) {
-				// leaf node... check each face in turn and update the nearest intersection as needed
-				for(int i=0; i<node.num_faces; i++) {
-					struct SurfPoint spt;
-					int fidx = node.face_idx[i];
-
-					if(intersect(ray, scn->faces + fidx, &spt) && spt.t < sp0.t) {
-						sp0 = spt;
-					}
-				}
-			} else {
-				// internal node... recurse to the children
-				idxstack[top++] = node.left;
-				idxstack[top++] = node.right;
-			}
-		}
-	}
+	return dot(ray.dir, sp->norm) >= 0.0 ? -sp->norm : sp->norm;
+}
 
-	if(!sp0.obj) {
+// reflection of the view direction, for the specular term
+float4 view_reflect(struct Ray ray, float4 norm)
+{
+	float4 vdir = -ray.dir;
+	vdir.x = native_divide(vdir.x, RAY_MAG);
+	vdir.y = native_divide(vdir.y, RAY_MAG);
+	vdir.z = native_divide(vdir.z, RAY_MAG);
+	return reflect(vdir, norm);
+}
+
+#define STACK_SIZE	MAX_TREE_DEPTH
+bool find_intersection(struct Ray ray, const struct Scene *scn, struct SurfPoint *spres, KDTREE_ARG kdtree)
+{
+	struct Hit hit;
+	if(!find_nearest(ray, scn, &hit, kdtree)) {
 		return false;
 	}
 
 	if(spres) {
-		*spres = sp0;
-		spres->mat = scn->matlib[sp0.obj->matid];
+		get_surface(ray, scn, &hit, spres);
 	}
 	return true;
 }
 
-bool intersect(struct Ray ray, global const struct Face *face, struct SurfPoint *sp)
+#ifndef KDTREE_ROPES
+bool find_nearest(struct Ray ray, const struct Scene *scn, struct Hit *hit, KDTREE_ARG kdtree)
 {
-	float4 origin = ray.origin;
-	float4 dir = ray.dir;
-	float4 norm = face->normal;
-
-	float ndotdir = dot(dir, norm);
-
-	if(fabs(ndotdir) <= EPSILON) {
+	// nearest hit so far, the shading data is only fetched for the final one
+	float tnear = 1.0;
+	float2 hit_uv = (float2)(0, 0);
+	int hit_face = -1;
+
+	// clip the ray to the bounds of the tree
+	float tmin, tmax;
+	if(!intersect_aabb(ray, scn->kdtree_aabb, &tmin, &tmax)) {
+		hit->face = -1;
 		return false;
 	}
 
-	float4 pt = face->v[0].pos;
-	float4 vec = pt - origin;
+	struct KDRay kdray;
+	init_kdray(&kdray, ray);
 
-	float ndotvec = dot(norm, vec);
-	float t = native_divide(ndotvec, ndotdir);
+	struct KDStackItem stack[STACK_SIZE];
+	int top = 0;	// points after the topmost element of the stack
+	int idx = 0;	// root at tree[0]
 
-	if(t < EPSILON || t > 1.0) {
-		return false;
-	}
-	pt = origin + dir * t;
+	for(;;) {
+		uint2 node = find_leaf(idx, &tmin, &tmax, stack, &top, &kdray, kdtree);
 
+		// leaf node... check each face in turn and update the nearest intersection as needed
+		int face_offset = node.x;
+		int num_faces = node.y >> 2;
 
-	float4 bc = calc_bary(pt, face, norm);
-	float bc_sum = bc.x + bc.y + bc.z;
+		for(int i=0; i<num_faces; i++) {
+			float t;
+			float2 uv;
+			int fidx = scn->kdleaves[face_offset + i];
 
-	if(bc_sum < 1.0 - EPSILON || bc_sum > 1.0 + EPSILON) {
-		return false;
+			if(intersect(ray, scn->tris + fidx, &t, &uv) && t < tnear) {
+				tnear = t;
+				hit_uv = uv;
+				hit_face = fidx;
+			}
+		}
+
+		/* a hit inside this leaf's interval is closer than anything in the
+		 * leaves after it. Hits further away (the face sticks out of the leaf)
+		 * still have to be checked against the next leaves.
+		 */
+		if(tnear <= tmax || top == 0) {
+			break;
+		}
+		top--;
+		idx = stack[top].node;
+		tmin = stack[top].tmin;
+		tmax = stack[top].tmax;
+
+		if(tmin > tnear) {
+			break;	// the rest of the stack is further away than the hit
+		}
 	}
 
-	sp->t = t;
-	sp->pos = pt;
-	sp->norm = normalize(face->v[0].normal * bc.x + face->v[1].normal * bc.y + face->v[2].normal * bc.z);
+	hit->t = tnear;
+	hit->u = hit_uv.x;
+	hit->v = hit_uv.y;
+	hit->face = hit_face;
+	return hit_face >= 0;
+}
+#endif	/* !KDTREE_ROPES */
+
+// interpolates the shading data of a hit found by find_nearest
+void get_surface(struct Ray ray, const struct Scene *scn, const struct Hit *hit, struct SurfPoint *sp)
+{
+	global const struct FaceShading *face = scn->faces + hit->face;
+	float4 bc = (float4)(1.0f - hit->u - hit->v, hit->u, hit->v, 0.0f);
+
+	sp->t = hit->t;
+	sp->pos = ray.origin + ray.dir * hit->t;
+	sp->norm = normalize(face->normal[0] * bc.x + face->normal[1] * bc.y + face->normal[2] * bc.z);
 	sp->obj = face;
 	sp->dbg = bc;
-	return true;
+	sp->mat = scn->matlib[face->matid];
 }
 
-bool intersect_aabb(struct Ray ray, struct AABBox aabb)
+#ifndef KDTREE_ROPES
+/* any-hit query for shadow rays: returns as soon as anything intersects the
+ * ray segment, without looking for the nearest hit.
+ */
+bool find_occlusion(struct Ray ray, const struct Scene *scn, KDTREE_ARG kdtree)
 {
-	if(ray.origin.x >= aabb.min.x && ray.origin.y >= aabb.min.y && ray.origin.z >= aabb.min.z &&
-			ray.origin.x < aabb.max.x && ray.origin.y < aabb.max.y && ray.origin.z < aabb.max.z) {
-		return true;
+	float tmin, tmax;
+	if(!intersect_aabb(ray, scn->kdtree_aabb, &tmin, &tmax)) {
+		return false;
 	}
 
-	float4 bbox[2] = {
-		{aabb.min.x, aabb.min.y, aabb.min.z, 0},
-		{aabb.max.x, aabb.max.y, aabb.max.z, 0}
-	};
+	struct KDRay kdray;
+	init_kdray(&kdray, ray);
 
-	int xsign = (int)(ray.dir.x < 0.0);
-	float invdirx = native_recip(ray.dir.x);
-	float tmin = (bbox[xsign].x - ray.origin.x) * invdirx;
-	float tmax = (bbox[1 - xsign].x - ray.origin.x) * invdirx;
+	struct KDStackItem stack[STACK_SIZE];
+	int top = 0;
+	int idx = 0;
 
-	int ysign = (int)(ray.dir.y < 0.0);
-	float invdiry = native_recip(ray.dir.y);
-	float tymin = (bbox[ysign].y - ray.origin.y) * invdiry;
-	float tymax = (bbox[1 - ysign].y - ray.origin.y) * invdiry;
+	for(;;) {
+		uint2 node = find_leaf(idx, &tmin, &tmax, stack, &top, &kdray, kdtree);
 
-	if(tmin > tymax || tymin > tmax) {
-		return false;
+		int face_offset = node.x;
+		int num_faces = node.y >> 2;
+
+		for(int i=0; i<num_faces; i++) {
+			float t;
+			float2 uv;
+			int fidx = scn->kdleaves[face_offset + i];
+
+			if(intersect(ray, scn->tris + fidx, &t, &uv)) {
+				return true;
+			}
+		}
+
+		if(top == 0) {
+			return false;
+		}
+		top--;
+		idx = stack[top].node;
+		tmin = stack[top].tmin;
+		tmax = stack[top].tmax;
 	}
+}
 
-	if(tymin > tmin) tmin = tymin;
-	if(tymax < tmax) tmax = tymax;
+#else	/* KDTREE_ROPES */
 
-	int zsign = (int)(ray.dir.z < 0.0);
-	float invdirz = native_recip(ray.dir.z);
-	float tzmin = (bbox[zsign].z - ray.origin.z) * invdirz;
-	float tzmax = (bbox[1 - zsign].z - ray.origin.z) * invdirz;
+/* stackless traversal: find the leaf containing the point where the ray
+ * enters, test its faces, and go on to the neighbour behind the face of the
+ * leaf the ray exits from, until there's a hit before the exit point or the
+ * ray leaves the tree.
+ */
+bool find_nearest(struct Ray ray, const struct Scene *scn, struct Hit *hit, KDTREE_ARG kdtree)
+{
+	float tnear = 1.0;
+	float2 hit_uv = (float2)(0, 0);
+	int hit_face = -1;
 
-	if(tmin > tzmax || tzmin > tmax) {
+	float tmin, tmax;
+	if(!intersect_aabb(ray, scn->kdtree_aabb, &tmin, &tmax)) {
+		hit->face = -1;
 		return false;
 	}
 
-	return tmin < 1.0 && tmax > 0.0;
+	struct KDRay kdray;
+	init_kdray(&kdray, ray);
+
+	int idx = 0;
+
+	while(idx >= 0) {
+		global const struct KDLeafGPU *leaf = scn->kdropes + find_rope_leaf(idx, tmin, &kdray, kdtree);
+
+		int face_offset = leaf->face_offset;
+		int num_faces = leaf->num_faces;
+
+		for(int i=0; i<num_faces; i++) {
+			float t;
+			float2 uv;
+			int fidx = scn->kdleaves[face_offset + i];
+
+			if(intersect(ray, scn->tris + fidx, &t, &uv) && t < tnear) {
+				tnear = t;
+				hit_uv = uv;
+				hit_face = fidx;
+			}
+		}
+
+		float texit = tmax;
+		int exit_face = leaf_exit(leaf, &kdray, &texit);
+
+		if(exit_face < 0 || tnear <= texit) {
+			break;
+		}
+		idx = leaf->rope[exit_face];
+		tmin = texit;
+	}
+
+	hit->t = tnear;
+	hit->u = hit_uv.x;
+	hit->v = hit_uv.y;
+	hit->face = hit_face;
+	return hit_face >= 0;
 }
 
-float4 reflect(float4 v, float4 n)
+bool find_occlusion(struct Ray ray, const struct Scene *scn, KDTREE_ARG kdtree)
 {
-	return 2.0f * dot(v, n) * n - v;
+	float tmin, tmax;
+	if(!intersect_aabb(ray, scn->kdtree_aabb, &tmin, &tmax)) {
+		return false;
+	}
+
+	struct KDRay kdray;
+	init_kdray(&kdray, ray);
+
+	int idx = 0;
+
+	while(idx >= 0) {
+		global const struct KDLeafGPU *leaf = scn->kdropes + find_rope_leaf(idx, tmin, &kdray, kdtree);
+
+		int face_offset = leaf->face_offset;
+		int num_faces = leaf->num_faces;
+
+		for(int i=0; i<num_faces; i++) {
+			float t;
+			float2 uv;
+			int fidx = scn->kdleaves[face_offset + i];
+
+			if(intersect(ray, scn->tris + fidx, &t, &uv)) {
+				return true;
+			}
+		}
+
+		float texit = tmax;
+		int exit_face = leaf_exit(leaf, &kdray, &texit);
+
+		if(exit_face < 0) {
+			break;
+		}
+		idx = leaf->rope[exit_face];
+		tmin = texit;
+	}
+	return false;
 }
 
-float4 transform(float4 v, global const float *xform)
+/* descends from node idx to the leaf containing the point of the ray at t,
+ * returns the index of its KDLeafGPU. A point on a split plane goes to the
+ * side the ray is heading to, so that it doesn't end up in the leaf it's
+ * just leaving.
+ */
+int find_rope_leaf(int idx, float t, const struct KDRay *kdray, KDTREE_ARG kdtree)
 {
-	float4 res;
-	res.x = v.x * xform[0] + v.y * xform[4] + v.z * xform[8] + xform[12];
-	res.y = v.x * xform[1] + v.y * xform[5] + v.z * xform[9] + xform[13];
-	res.z = v.x * xform[2] + v.y * xform[6] + v.z * xform[10] + xform[14];
-	res.w = 0.0;
-	return res;
+	uint2 node = read_kdnode(idx, kdtree);
+
+	while((node.y & 3) != KDNODE_LEAF) {
+		int axis = node.y & 3;
+		float split = as_float(node.x);
+		float pos = kdray->org[axis] + kdray->dir[axis] * t;
+
+		bool left = pos < split || (pos == split && kdray->dir[axis] <= 0.0f);
+		idx = (node.y >> 2) + (left ? 0 : 1);
+		node = read_kdnode(idx, kdtree);
+	}
+	return node.x;
 }
 
-void transform_ray(struct Ray *ray, global const float *xform, global const float *invtrans)
+/* finds the face of the leaf the ray exits from, in the direction of the ray
+ * on each axis. Returns its rope index and sets texit to where it crosses it,
+ * or returns -1 if the ray ends before leaving the leaf. The side is picked by
+ * the sign of invdir, so that axes the ray is parallel to give +inf.
+ */
+int leaf_exit(global const struct KDLeafGPU *leaf, const struct KDRay *kdray, float *texit)
 {
-	ray->origin = transform(ray->origin, xform);
-	ray->dir = transform(ray->dir, invtrans);
+	int exit_face = -1;
+
+	for(int i=0; i<3; i++) {
+		bool pos_dir = kdray->invdir[i] > 0.0f;
+		float bound = pos_dir ? leaf->max[i] : leaf->min[i];
+		float t = (bound - kdray->org[i]) * kdray->invdir[i];
+
+		if(t < *texit) {
+			*texit = t;
+			exit_face = i * 2 + (pos_dir ? 1 : 0);
+		}
+	}
+	return exit_face;
 }
+#endif	/* KDTREE_ROPES */
 
-float4 calc_bary(float4 pt, global const struct Face *face, float4 norm)
+void init_kdray(struct KDRay *kdray, struct Ray ray)
 {
-	float4 bc = (float4)(0, 0, 0, 0);
+	kdray->org[0] = ray.origin.x;
+	kdray->org[1] = ray.origin.y;
+	kdray->org[2] = ray.origin.z;
+	kdray->dir[0] = ray.dir.x;
+	kdray->dir[1] = ray.dir.y;
+	kdray->dir[2] = ray.dir.z;
+	kdray->invdir[0] = native_recip(ray.dir.x);
+	kdray->invdir[1] = native_recip(ray.dir.y);
+	kdray->invdir[2] = native_recip(ray.dir.z);
+}
 
-	// calculate area of the whole triangle
-	float4 v1 = face->v[1].pos - face->v[0].pos;
-	float4 v2 = face->v[2].pos - face->v[0].pos;
-	float4 xv1v2 = cross(v1, v2);
+/* walk down from node idx to a leaf, clipping [tmin, tmax] to the children.
+ * The nodes have no bounds, only the split planes, so a child is skipped
+ * whenever the ray's interval doesn't reach it. When the ray goes through
+ * both, the near child is visited first and the far one is pushed, so leaves
+ * are visited in front to back order. Returns the leaf node.
+ */
+uint2 find_leaf(int idx, float *tmin, float *tmax, struct KDStackItem *stack, int *top,
+		const struct KDRay *kdray, KDTREE_ARG kdtree)
+{
+	uint2 node = read_kdnode(idx, kdtree);
+
+	while((node.y & 3) != KDNODE_LEAF) {
+		int axis = node.y & 3;
+		int left = node.y >> 2;
+		float split = as_float(node.x);
+		float org = kdray->org[axis];
+		float tsplit = (split - org) * kdray->invdir[axis];
+
+		// the child on the origin's side comes first along the ray
+		bool org_left = org < split || (org == split && kdray->dir[axis] <= 0.0f);
+		int first = org_left ? left : left + 1;
+		int second = org_left ? left + 1 : left;
+
+		if(!(tsplit > 0.0f) || tsplit > *tmax) {
+			idx = first;	// the ray doesn't cross the plane in the interval
+		} else if(tsplit < *tmin) {
+			idx = second;	// it crossed it before entering the node
+		} else {
+			stack[*top].node = second;
+			stack[*top].tmin = tsplit;
+			stack[*top].tmax = *tmax;
+			(*top)++;
 
-	float area = fabs(dot(xv1v2, norm)) * 0.5;
-	if(area < EPSILON) {
-		return bc;
+			idx = first;
+			*tmax = tsplit;
+		}
+		node = read_kdnode(idx, kdtree);
 	}
+	return node;
+}
 
-	float4 pv0 = face->v[0].pos - pt;
-	float4 pv1 = face->v[1].pos - pt;
-	float4 pv2 = face->v[2].pos - pt;
+/* Moller-Trumbore ray-triangle test, only touches the precomputed record. All
+ * the terms are computed up front and checked at once, so there's a single
+ * branch. Hits are accepted in [EPSILON, 1], uv are the barycentric coordinates
+ * of the hit with respect to the second and third vertex.
+ */
+bool intersect(struct Ray ray, global const struct TriAccel *tri, float *tres, float2 *uv)
+{
+	float4 e1 = tri->e1;
+	float4 e2 = tri->e2;
 
-	// calculate the area of each sub-triangle
-	float4 x12 = cross(pv1, pv2);
-	float4 x20 = cross(pv2, pv0);
-	float4 x01 = cross(pv0, pv1);
+	float4 pvec = cross(ray.dir, e2);
+	float det = dot(e1, pvec);
+	float inv_det = native_recip(det);
 
-	float a0 = fabs(dot(x12, norm)) * 0.5;
-	float a1 = fabs(dot(x20, norm)) * 0.5;
-	float a2 = fabs(dot(x01, norm)) * 0.5;
+	float4 tvec = ray.origin - tri->v0;
+	float4 qvec = cross(tvec, e1);
 
-	bc.x = native_divide(a0, area);
-	bc.y = native_divide(a1, area);
-	bc.z = native_divide(a2, area);
-	return bc;
+	float u = dot(tvec, pvec) * inv_det;
+	float v = dot(ray.dir, qvec) * inv_det;
+	float t = dot(e2, qvec) * inv_det;
+
+	*tres = t;
+	*uv = (float2)(u, v);
+	return det != 0.0f && u >= 0.0f && v >= 0.0f && u + v <= 1.0f && t >= EPSILON && t <= 1.0f;
+}
+
+// returns the part [tnear, tfar] of the ray segment [0, 1] inside the box
+bool intersect_aabb(struct Ray ray, struct AABBox aabb, float *tnear, float *tfar)
+{
+	float4 invdir = (float4)(native_recip(ray.dir.x), native_recip(ray.dir.y), native_recip(ray.dir.z), 0.0f);
+
+	float4 t0 = (aabb.min - ray.origin) * invdir;
+	float4 t1 = (aabb.max - ray.origin) * invdir;
+	float4 tmin = fmin(t0, t1);
+	float4 tmax = fmax(t0, t1);
+
+	*tnear = fmax(fmax(tmin.x, tmin.y), fmax(tmin.z, 0.0f));
+	*tfar = fmin(fmin(tmax.x, tmax.y), fmin(tmax.z, 1.0f));
+	return *tnear <= *tfar;
+}
+
+float4 reflect(float4 v, float4 n)
+{
+	return 2.0f * dot(v, n) * n - v;
+}
+
+/* ray through pixel (x, y), same as get_primary_ray in rt.cc followed by the
+ * camera transformation.
+ */
+struct Ray get_primary_ray(int x, int y, int w, int h, global const struct Camera *cam)
+{
+	float aspect = (float)w / (float)h;
+
+	float px = ((float)x / (float)w * 2.0f - 1.0f) * aspect;
+	float py = 1.0f - (float)y / (float)h * 2.0f;
+	float pz = native_recip(tan(0.5f * cam->vfov));
+
+	float4 dir = px * cam->right + py * cam->up - pz * cam->back;
+
+	struct Ray ray;
+	ray.origin = cam->pos;
+	ray.dir = normalize(dir) * RAY_MAG;
+	return ray;
 }
 
 float mean(float4 v)
@@ -362,32 +974,24 @@ float mean(float4 v)
 }
 
 
+#ifdef KDTREE_BUFFER
+uint2 read_kdnode(int idx, KDTREE_ARG kdtree)
+{
+	return kdtree[idx];
+}
+#else
 const sampler_t kdsampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_NONE | CLK_FILTER_NEAREST;
 
-// read a KD-tree node from a texture scanline
-void read_kdnode(int idx, struct KDNode *node, read_only image2d_t kdimg)
+// read a compact KD-tree node (see KDNodeGPU in scene.h), two of them per pixel
+uint2 read_kdnode(int idx, KDTREE_ARG kdtree)
 {
-	int startx = KDIMG_NODE_WIDTH * (idx / KDIMG_MAX_HEIGHT);
+	int pixel = idx >> 1;
 
 	int2 tc;
-	tc.x = startx;
-	tc.y = idx % KDIMG_MAX_HEIGHT;
-
-	node->aabb.min = read_imagef(kdimg, kdsampler, tc); tc.x++;
-	node->aabb.max = read_imagef(kdimg, kdsampler, tc);
-
-	tc.x = startx + 2 + MAX_NODE_FACES / 4;
-	float4 pix = read_imagef(kdimg, kdsampler, tc);
-	node->num_faces = (int)pix.x;
-	node->left = (int)pix.y;
-	node->right = (int)pix.z;
-
-	tc.x = startx + 2;
-	for(int i=0; i<node->num_faces; i+=4) {
-		float4 pix = read_imagef(kdimg, kdsampler, tc); tc.x++;
-		node->face_idx[i] = (int)pix.x;
-		node->face_idx[i + 1] = (int)pix.y;
-		node->face_idx[i + 2] = (int)pix.z;
-		node->face_idx[i + 3] = (int)pix.w;
-	}
+	tc.x = pixel % KDIMG_MAX_WIDTH;
+	tc.y = pixel / KDIMG_MAX_WIDTH;
+
+	uint4 pix = read_imageui(kdtree, kdsampler, tc);
+	return (idx & 1) ? pix.zw : pix.xy;
 }
+#endif
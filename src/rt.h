@@ -8,12 +8,23 @@ enum {
 	ROPT_ITER,
 	ROPT_SHAD,
 	ROPT_REFL,
+	ROPT_WAVEFRONT,	// render with the wavefront kernels instead of the single one
+	ROPT_PERSISTENT,	// render with a fixed number of work-items pulling pixels off a queue
+	ROPT_BATCH_SIZE,	// pixels per work-item fetched at once in persistent mode
+	ROPT_FOV,		// vertical field of view in degrees
+	ROPT_KDTREE_BUFFER,	// kd-tree in a buffer instead of an image, set before init_renderer
+	ROPT_KDTREE_ROPES,	// stackless kd-tree traversal with ropes, set before init_renderer
+	ROPT_SPECIALIZE,	// build the render kernel for the current options (on by default)
+	ROPT_TUNE_TILES,	// time work-group shapes for the render kernel (on by default)
+	ROPT_PIPELINE,		// keep a frame in flight while the previous one is displayed
+	ROPT_SCENE_ARENA,	// all static scene data in a single buffer, set before init_renderer
 
 	NUM_RENDER_OPTIONS
 };
 
 struct RendInfo {
 	float ambient[4];
+	float kdtree_min[4], kdtree_max[4];	// bounds of the kd-tree root
 	int xsz, ysz;
 	int num_faces, num_lights;
 	int max_iter;
@@ -24,9 +35,28 @@ struct Ray {
 	float origin[4], dir[4];
 };
 
+// primary rays are generated by the kernels from this
+struct Camera {
+	float pos[4];
+	float right[4], up[4], back[4];	// camera basis, it looks along -back
+	float vfov;		// vertical field of view in radians
+	float padding[3];
+};
+
 struct RenderStats {
 	unsigned long render_time, tex_update_time;
 
+	/* device side times of the OpenCL commands of the frame in msec, from
+	 * their profiling events. Each is the sum of the time the commands of
+	 * that kind spent executing.
+	 */
+	float kernel_time;
+	float transfer_time;	// buffer writes, reads, maps and copies
+	float gl_sync_time;		// acquiring and releasing the framebuffer texture
+	float queue_wait_time;	// from queueing the commands to them starting, summed
+	float device_time;		// from the first command queued to the last one finished
+	int num_commands;
+
 	int aabb_tests, triangle_tests;
 	int min_aabb_tests, max_aabb_tests;
 	float avg_aabb_tests;
@@ -42,11 +72,18 @@ struct RenderStats {
 bool init_renderer(int xsz, int ysz, Scene *scn, unsigned int tex);
 void destroy_renderer();
 bool render();
+// presents the frame still in flight in pipelined mode, if any
+bool finish_render();
 void set_xform(float *matrix, float *invtrans);
 
+// untransformed primary ray through pixel (x, y) of a w x h image
+Ray get_primary_ray(int x, int y, int w, int h, float vfov_deg);
+
 const RendInfo *get_render_info();
 const RenderStats *get_render_stats();
 void print_render_stats(FILE *out = stdout);
+// prints the times of every OpenCL command of the last frame
+void print_frame_profile(FILE *out = stdout);
 
 void set_render_option(int opt, bool val);
 void set_render_option(int opt, int val);
@@ -59,7 +96,6 @@ float get_render_option_float(int opt);
 // regular C++ raytracing using the KD-tree (single-threaded, keeps extensive debug stats)
 bool init_dbg_renderer(int xsz, int ysz, Scene *scn, unsigned int texid);
 void destroy_dbg_renderer();
-void dbg_set_primary_rays(const Ray *rays);
 void dbg_render(const float *xform, const float *invtrans_xform, int num_threads = -1);
 
 
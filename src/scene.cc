@@ -3,10 +3,14 @@
 #include <math.h>
 #include <float.h>
 #include <assert.h>
+#include <new>
 #include <map>
+#include <algorithm>
 #include "scene.h"
 #include "ogl.h"
 #include "vector.h"
+#include "timer.h"
+#include "tpool.h"
 
 #define CHECK_AABB(aabb)	\
 	assert(aabb.max[0] >= aabb.min[0] && aabb.max[1] >= aabb.min[1] && aabb.max[2] >= aabb.min[2])
@@ -15,14 +19,69 @@
 #define MIN(a, b)	((a) < (b) ? (a) : (b))
 #define MAX(a, b)	((a) > (b) ? (a) : (b))
 
+/* upper limit for ACCEL_PARAM_NUM_BINS */
+#define MAX_SAH_BINS	256
+
+/* nodes need at least this many faces on both children to build them in parallel */
+#define PAR_SUBTREE_MIN_FACES	1024
+/* nodes with at least this many faces evaluate each axis in parallel */
+#define PAR_SPLIT_MIN_FACES		16384
+
+
+/* Event-sweep SAH construction (Wald & Havran 2006)
+ * Every face contributes a start and an end event (or a single planar event
+ * if it's flat along the axis) at the extents of its bounding box, on each
+ * axis. The events are sorted once for the root, and sweeping over them in
+ * order gives us the number of faces on either side of every candidate plane
+ * in constant time. Unclipped faces keep their events, so the event lists
+ * of the children are mostly the subsequences of the parent's lists that refer
+ * to their faces. They stay sorted, and the whole build is O(N log N).
+ *
+ * With ACCEL_PARAM_PERFECT_SPLITS, faces straddling a split are clipped to
+ * each child voxel, and their events in the children are taken from the
+ * bounds of the clipped part. Faces not actually overlapping a child are
+ * dropped from it, and the new events are sorted and merged into the lists.
+ */
+enum { EV_END, EV_PLANAR, EV_START };
+
+struct SplitEvent {
+	float pos;
+	int type;
+	int face;
+
+	bool operator <(const SplitEvent &rhs) const
+	{
+		if(pos != rhs.pos) return pos < rhs.pos;
+		if(type != rhs.type) return type < rhs.type;
+		return face < rhs.face;
+	}
+};
+
+// per-node state of the sweep builder, event faces are indices into face_idx
+struct SweepState {
+	std::vector<int> face_idx;
+	std::vector<SplitEvent> events[3];
+	std::vector<AABBox> bounds;		// clipped face bounds, only with perfect splits
+};
+
+enum { SIDE_LEFT = 1, SIDE_RIGHT = 2, SIDE_CLIPPED = 4 };
 
-static int flatten_kdtree(const KDNode *node, KDNodeGPU *kdbuf, int *count);
+static void flatten_kdtree(const KDNode *node, int idx, KDNodeGPU *kdbuf, int *count, int *leafbuf, int *leaf_count);
+static int count_leaf_items(const KDNode *node);
+static void build_ropes(KDNodeGPU *nodes, int idx, const AABBox &aabb, const int *ropes, std::vector<KDLeafGPU> *leaves);
+static int optimize_rope(const KDNodeGPU *nodes, int rope, int face, const AABBox &aabb);
 static void draw_kdtree(const KDNode *node, int level = 0);
-static bool build_kdtree(KDNode *kd, const Face *faces, int level = 0);
+static bool build_kdtree(KDNode *kd, const Face *faces, std::vector<int> *face_idx, int level = 0);
+static bool build_kdtree_sweep(KDNode *kd, const Face *faces, SweepState *st, int level = 0);
+static void init_sweep_state(const Face *faces, int num_faces, SweepState *st);
+static void merge_split_events(std::vector<SplitEvent> *events, std::vector<SplitEvent> *newev);
+static bool build_kdtree_binned(KDNode *kd, const Face *faces, std::vector<int> *face_idx, int level = 0);
 static float eval_cost(const Face *faces, const int *face_idx, int num_faces, const AABBox &aabb, int axis);
-static void free_kdtree(KDNode *node);
+static float sah_cost(const AABBox &aabb, int num_faces);
 static void print_item_counts(const KDNode *node, int level);
 static int clip_face(const Face &inface, float splitpos, int axis, int sign, Face *faces);
+static bool clip_face_bounds(const Face &face, const AABBox &voxel, AABBox *bounds);
+static void calc_face_bounds(const Face &face, AABBox *bounds);
 static float calc_sq_area(const Vector3 &a, const Vector3 &b, const Vector3 &c);
 
 
@@ -30,7 +89,11 @@ static int accel_param[NUM_ACCEL_PARAMS] = {
 	64,	// max tree depth
 	MAX_NODE_FACES,	// max items per node (0 means ignore limit)
 	5,	// estimated traversal cost
-	15	// estimated interseciton cost
+	15,	// estimated interseciton cost
+	KDBUILD_SWEEP,	// construction algorithm
+	32,	// number of bins per axis for KDBUILD_BINNED
+	0,	// construction threads (0 means one per processor)
+	0	// clip faces to the voxels during construction (KDBUILD_SWEEP)
 };
 
 
@@ -41,6 +104,112 @@ void set_accel_param(int p, int v)
 }
 
 
+/* Parallel construction
+ * The sweep and binned builders run the left subtree of big nodes as a task
+ * on build_pool while recursing to the right, and evaluate the three axes of
+ * huge nodes concurrently. Splits are always picked in axis order and the
+ * face and event lists keep the order of their parent, so the resulting tree
+ * does not depend on the number of threads.
+ */
+static ThreadPool *build_pool;
+
+struct AxisTask {
+	void (*func)(int, void*);
+	int axis;
+	void *data;
+};
+
+static void axis_task(void *cls)
+{
+	AxisTask *task = (AxisTask*)cls;
+	task->func(task->axis, task->data);
+}
+
+static void run_per_axis(void (*func)(int, void*), void *data, bool parallel)
+{
+	if(!parallel || !build_pool) {
+		for(int i=0; i<3; i++) {
+			func(i, data);
+		}
+		return;
+	}
+
+	AxisTask tasks[3];
+	TaskGroup grp;
+
+	for(int i=0; i<3; i++) {
+		tasks[i].func = func;
+		tasks[i].axis = i;
+		tasks[i].data = data;
+	}
+
+	tpool_spawn(build_pool, &grp, axis_task, tasks);
+	tpool_spawn(build_pool, &grp, axis_task, tasks + 1);
+	axis_task(tasks + 2);
+	tpool_wait(build_pool, &grp);
+}
+
+
+/* Construction memory
+ * Nodes and the face lists of the leaves are carved out of the scene's arena,
+ * and the whole tree is freed at once by releasing it. The face and event
+ * lists of the nodes under construction are scratch vectors: the left child
+ * takes over its parent's lists, filtered in place, and the right child gets
+ * lists from a per-thread pool, which the leaves refill when they're done
+ * with theirs. Capacity is thus recycled from level to level, instead of
+ * allocating and freeing a few vectors for every node.
+ */
+static Arena *build_arena;
+
+struct ScratchPool {
+	std::vector<std::vector<int> > idx;
+	std::vector<std::vector<SplitEvent> > events;
+};
+static ScratchPool *scratch_pools;	// one per build thread
+
+static ScratchPool *cur_scratch_pool()
+{
+	return scratch_pools + tpool_thread_index(build_pool);
+}
+
+template <class T>
+static void get_scratch(std::vector<std::vector<T> > *pool, std::vector<T> *list)
+{
+	if(!pool->empty()) {
+		list->swap(pool->back());
+		pool->pop_back();
+	}
+	list->clear();
+}
+
+template <class T>
+static void put_scratch(std::vector<std::vector<T> > *pool, std::vector<T> *list)
+{
+	if(list->capacity()) {
+		pool->push_back(std::vector<T>());
+		pool->back().swap(*list);
+	}
+}
+
+static KDNode *alloc_node()
+{
+	void *mem = build_arena->alloc(sizeof(KDNode));
+	return mem ? new(mem) KDNode : 0;
+}
+
+// moves the remaining faces of a node to the arena, turning it into a leaf
+static bool make_leaf(KDNode *kd, const std::vector<int> &face_idx)
+{
+	kd->num_faces = (int)face_idx.size();
+	if(kd->num_faces) {
+		if(!(kd->face_idx = (int*)build_arena->alloc(kd->num_faces * sizeof *kd->face_idx))) {
+			return false;
+		}
+		memcpy(kd->face_idx, &face_idx[0], kd->num_faces * sizeof *kd->face_idx);
+	}
+	return true;
+}
+
 float AABBox::calc_surface_area() const
 {
 	float area1 = (max[0] - min[0]) * (max[1] - min[1]);
@@ -53,6 +222,8 @@ float AABBox::calc_surface_area() const
 KDNode::KDNode()
 {
 	left = right = 0;
+	face_idx = 0;
+	num_faces = 0;
 	cost = 0.0;
 }
 
@@ -60,16 +231,30 @@ KDNode::KDNode()
 Scene::Scene()
 {
 	facebuf = 0;
+	tribuf = 0;
+	shadebuf = 0;
 	num_faces = -1;
 	kdtree = 0;
 	kdbuf = 0;
+	kdbuf_size = 0;
+	kdleafbuf = 0;
+	kdleafbuf_size = 0;
+	kdropenodes = 0;
+	kdropebuf = 0;
+	kdropebuf_size = 0;
+	kdcache_fname = 0;
 }
 
 Scene::~Scene()
 {
 	delete [] facebuf;
+	delete [] tribuf;
+	delete [] shadebuf;
 	delete [] kdbuf;
-	free_kdtree(kdtree);
+	delete [] kdleafbuf;
+	delete [] kdropenodes;
+	delete [] kdropebuf;
+	delete [] kdcache_fname;
 }
 
 bool Scene::add_mesh(Mesh *m)
@@ -89,6 +274,10 @@ bool Scene::add_mesh(Mesh *m)
 	// invalidate facebuffer and count
 	delete [] facebuf;
 	facebuf = 0;
+	delete [] tribuf;
+	tribuf = 0;
+	delete [] shadebuf;
+	shadebuf = 0;
 	num_faces = -1;
 
 	return true;
@@ -138,6 +327,30 @@ int Scene::get_num_kdnodes() const
 	return kdtree_nodes(kdtree);
 }
 
+int Scene::get_kdtree_buffer_size() const
+{
+	if(!kdbuf) {
+		get_kdtree_buffer();
+	}
+	return kdbuf_size;
+}
+
+int Scene::get_num_kdtree_leaf_items() const
+{
+	if(!kdleafbuf) {
+		get_kdtree_buffer();
+	}
+	return kdleafbuf_size;
+}
+
+int Scene::get_num_kdtree_rope_leaves() const
+{
+	if(!kdropebuf) {
+		get_kdtree_rope_buffer();
+	}
+	return kdropebuf_size;
+}
+
 Mesh **Scene::get_meshes()
 {
 	if(meshes.empty()) {
@@ -206,6 +419,53 @@ const Face *Scene::get_face_buffer() const
 	return facebuf;
 }
 
+const TriAccel *Scene::get_tri_accel_buffer() const
+{
+	if(tribuf) {
+		return tribuf;
+	}
+
+	const Face *faces = get_face_buffer();
+	tribuf = new TriAccel[num_faces > 0 ? num_faces : 1];
+
+	for(int i=0; i<num_faces; i++) {
+		const float *p0 = faces[i].v[0].pos;
+		const float *p1 = faces[i].v[1].pos;
+		const float *p2 = faces[i].v[2].pos;
+		TriAccel *tri = tribuf + i;
+
+		for(int j=0; j<3; j++) {
+			tri->v0[j] = p0[j];
+			tri->e1[j] = p1[j] - p0[j];
+			tri->e2[j] = p2[j] - p0[j];
+		}
+		tri->v0[3] = tri->e1[3] = tri->e2[3] = 0.0;
+	}
+	return tribuf;
+}
+
+const FaceShading *Scene::get_face_shading_buffer() const
+{
+	if(shadebuf) {
+		return shadebuf;
+	}
+
+	const Face *faces = get_face_buffer();
+	int count = num_faces > 0 ? num_faces : 1;
+	shadebuf = new FaceShading[count];
+	memset(shadebuf, 0, count * sizeof *shadebuf);
+
+	for(int i=0; i<num_faces; i++) {
+		for(int j=0; j<3; j++) {
+			memcpy(shadebuf[i].normal[j], faces[i].v[j].normal, sizeof shadebuf[i].normal[j]);
+			shadebuf[i].tex[j][0] = faces[i].v[j].tex[0];
+			shadebuf[i].tex[j][1] = faces[i].v[j].tex[1];
+		}
+		shadebuf[i].matid = faces[i].matid;
+	}
+	return shadebuf;
+}
+
 const KDNodeGPU *Scene::get_kdtree_buffer() const
 {
 	if(kdbuf) {
@@ -216,46 +476,155 @@ const KDNodeGPU *Scene::get_kdtree_buffer() const
 		((Scene*)this)->build_kdtree();
 	}
 
-	int num_nodes = get_num_kdnodes();
-	kdbuf = new KDNodeGPU[num_nodes];
+	kdbuf_size = get_num_kdnodes() + 1;	// plus the one after the root
+	kdbuf = new KDNodeGPU[kdbuf_size];
+	memset(kdbuf, 0, kdbuf_size * sizeof *kdbuf);
 
-	int count = 0;
+	delete [] kdleafbuf;
+	kdleafbuf_size = count_leaf_items(kdtree);
+	kdleafbuf = new int[kdleafbuf_size > 0 ? kdleafbuf_size : 1];	// never hand out an empty buffer
+
+	int count = 2, leaf_count = 0;
 
 	// first arrange the kdnodes into an array (flatten)
-	flatten_kdtree(kdtree, kdbuf, &count);
+	flatten_kdtree(kdtree, 0, kdbuf, &count, kdleafbuf, &leaf_count);
+	assert(count == kdbuf_size);
 
 	return kdbuf;
 }
 
-static int flatten_kdtree(const KDNode *node, KDNodeGPU *kdbuf, int *count)
+const int *Scene::get_kdtree_leaf_buffer() const
+{
+	if(!kdleafbuf) {
+		get_kdtree_buffer();
+	}
+	return kdleafbuf;
+}
+
+const KDNodeGPU *Scene::get_kdtree_rope_nodes() const
+{
+	if(!kdropenodes) {
+		get_kdtree_rope_buffer();
+	}
+	return kdropenodes;
+}
+
+const KDLeafGPU *Scene::get_kdtree_rope_buffer() const
 {
-	const size_t max_node_items = sizeof kdbuf[0].face_idx / sizeof kdbuf[0].face_idx[0];
-	int idx = (*count)++;
+	if(kdropebuf) {
+		return kdropebuf;
+	}
 
-	// copy the node
-	kdbuf[idx].aabb = node->aabb;
-	kdbuf[idx].num_faces = 0;
+	const KDNodeGPU *nodes = get_kdtree_buffer();
+	if(!nodes) {
+		return 0;
+	}
 
-	for(size_t i=0; i<node->face_idx.size(); i++) {
-		if(i >= max_node_items) {
-			fprintf(stderr, "WARNING too many faces per leaf node!\n");
-			break;
+	kdropenodes = new KDNodeGPU[kdbuf_size];
+	memcpy(kdropenodes, nodes, kdbuf_size * sizeof *kdropenodes);
+
+	std::vector<KDLeafGPU> leaves;
+	int ropes[6] = {-1, -1, -1, -1, -1, -1};
+	build_ropes(kdropenodes, 0, kdtree->aabb, ropes, &leaves);
+
+	kdropebuf_size = (int)leaves.size();
+	kdropebuf = new KDLeafGPU[kdropebuf_size];
+	memcpy(kdropebuf, &leaves[0], kdropebuf_size * sizeof *kdropebuf);
+	return kdropebuf;
+}
+
+// writes the node at kdbuf[idx], the children of interior nodes get the next free pair
+static void flatten_kdtree(const KDNode *node, int idx, KDNodeGPU *kdbuf, int *count, int *leafbuf, int *leaf_count)
+{
+	if(!node->left) {
+		kdbuf[idx].face_offset = *leaf_count;
+		kdbuf[idx].info = (node->num_faces << 2) | KDNODE_LEAF;
+
+		// append its faces (if any) to the leaf buffer
+		for(int i=0; i<node->num_faces; i++) {
+			leafbuf[(*leaf_count)++] = node->face_idx[i];
 		}
-		kdbuf[idx].face_idx[i] = node->face_idx[i];
-		kdbuf[idx].num_faces++;
+		return;
 	}
+	assert(node->right);
 
-	// recurse to the left/right (if we're not in a leaf node)
-	if(node->left) {
-		assert(node->right);
+	int left = *count;
+	*count += 2;
 
-		kdbuf[idx].left = flatten_kdtree(node->left, kdbuf, count);
-		kdbuf[idx].right = flatten_kdtree(node->right, kdbuf, count);
-	} else {
-		kdbuf[idx].left = kdbuf[idx].right = -1;
+	kdbuf[idx].split = node->left->aabb.max[node->axis];
+	kdbuf[idx].info = (left << 2) | node->axis;
+
+	flatten_kdtree(node->left, left, kdbuf, count, leafbuf, leaf_count);
+	flatten_kdtree(node->right, left + 1, kdbuf, count, leafbuf, leaf_count);
+}
+
+/* the children of a node share its ropes, except across the split plane,
+ * where each of them gets the other as its neighbour.
+ */
+static void build_ropes(KDNodeGPU *nodes, int idx, const AABBox &aabb, const int *ropes, std::vector<KDLeafGPU> *leaves)
+{
+	KDNodeGPU *node = nodes + idx;
+
+	if((node->info & 3) == KDNODE_LEAF) {
+		KDLeafGPU leaf;
+		memset(&leaf, 0, sizeof leaf);
+
+		for(int i=0; i<3; i++) {
+			leaf.min[i] = aabb.min[i];
+			leaf.max[i] = aabb.max[i];
+		}
+		leaf.face_offset = node->face_offset;
+		leaf.num_faces = node->info >> 2;
+
+		for(int i=0; i<6; i++) {
+			leaf.rope[i] = optimize_rope(nodes, ropes[i], i, aabb);
+		}
+
+		node->face_offset = leaves->size();
+		leaves->push_back(leaf);
+		return;
 	}
 
-	return idx;
+	int axis = node->info & 3;
+	int left = node->info >> 2;
+
+	int lropes[6], rropes[6];
+	memcpy(lropes, ropes, sizeof lropes);
+	memcpy(rropes, ropes, sizeof rropes);
+	lropes[axis * 2 + 1] = left + 1;
+	rropes[axis * 2] = left;
+
+	AABBox laabb = aabb, raabb = aabb;
+	laabb.max[axis] = raabb.min[axis] = node->split;
+
+	build_ropes(nodes, left, laabb, lropes, leaves);
+	build_ropes(nodes, left + 1, raabb, rropes, leaves);
+}
+
+/* moves a rope of a leaf down the tree, as long as the face it leaves through
+ * is entirely on one side of the split, so that the traversal has less to
+ * descend after following it.
+ */
+static int optimize_rope(const KDNodeGPU *nodes, int rope, int face, const AABBox &aabb)
+{
+	int face_axis = face / 2;
+
+	while(rope >= 0 && (nodes[rope].info & 3) != KDNODE_LEAF) {
+		int axis = nodes[rope].info & 3;
+		int left = nodes[rope].info >> 2;
+		float split = nodes[rope].split;
+
+		if(axis == face_axis) {
+			rope = (face & 1) ? left : left + 1;	// the child touching the face
+		} else if(split >= aabb.max[axis]) {
+			rope = left;
+		} else if(split <= aabb.min[axis]) {
+			rope = left + 1;
+		} else {
+			break;
+		}
+	}
+	return rope;
 }
 
 void Scene::draw_kdtree() const
@@ -319,6 +688,17 @@ static void draw_kdtree(const KDNode *node, int level)
 	glVertex3f(node->aabb.min[0], node->aabb.max[1], node->aabb.max[2]);
 }
 
+void Scene::set_kdtree_cache(const char *fname)
+{
+	delete [] kdcache_fname;
+	kdcache_fname = 0;
+
+	if(fname && *fname) {
+		kdcache_fname = new char[strlen(fname) + 1];
+		strcpy(kdcache_fname, fname);
+	}
+}
+
 bool Scene::build_kdtree()
 {
 	assert(kdtree == 0);
@@ -333,12 +713,32 @@ bool Scene::build_kdtree()
 	printf("  max items per leaf: %d\n", accel_param[ACCEL_PARAM_MAX_NODE_ITEMS]);
 	printf("  SAH parameters - tcost: %d - icost: %d\n", tcost, icost);
 
-	free_kdtree(kdtree);
-	kdtree = new KDNode;
+	kdarena.release();
+
+	uint64_t cache_key = 0;
+	if(kdcache_fname) {
+		cache_key = kdtree_cache_key(faces, num_faces);
+
+		if((kdtree = kdtree_restore(kdcache_fname, cache_key, num_faces, &kdarena))) {
+			printf("  loaded from cache: %s\n", kdcache_fname);
+			printf("  tree depth: %d\n", kdtree_depth(kdtree));
+			print_item_counts(kdtree, 0);
+			return true;
+		}
+	}
+
+	build_arena = &kdarena;
+
+	if(!(kdtree = alloc_node())) {
+		fprintf(stderr, "failed to allocate kdtree root\n");
+		return false;
+	}
 
 	/* Start the construction of the kdtree by adding all faces of the scene
 	 * to the new root node. At the same time calculate the root's AABB.
 	 */
+	std::vector<int> face_idx(num_faces);
+
 	kdtree->aabb.min[0] = kdtree->aabb.min[1] = kdtree->aabb.min[2] = FLT_MAX;
 	kdtree->aabb.max[0] = kdtree->aabb.max[1] = kdtree->aabb.max[2] = -FLT_MAX;
 
@@ -360,22 +760,76 @@ bool Scene::build_kdtree()
 			}
 		}
 
-		kdtree->face_idx.push_back(i);	// add the face
+		face_idx[i] = i;	// add the face
 	}
 
 	CHECK_AABB(kdtree->aabb);
 
-	// calculate the heuristic for the root
-	kdtree->cost = eval_cost(faces, &kdtree->face_idx[0], kdtree->face_idx.size(), kdtree->aabb, 0);
+	long start_time = get_msec();
+	bool res;
+
+	int num_threads = accel_param[ACCEL_PARAM_NUM_THREADS];
+	if(accel_param[ACCEL_PARAM_BUILD_METHOD] != KDBUILD_NAIVE && num_threads != 1) {
+		build_pool = tpool_create(num_threads);
+		printf("  construction threads: %d\n", tpool_num_threads(build_pool));
+	}
+	scratch_pools = new ScratchPool[tpool_num_threads(build_pool)];
+
+	switch(accel_param[ACCEL_PARAM_BUILD_METHOD]) {
+	case KDBUILD_NAIVE:
+		// calculate the heuristic for the root
+		kdtree->cost = eval_cost(faces, &face_idx[0], num_faces, kdtree->aabb, 0);
+
+		// now proceed splitting the root recursively
+		res = ::build_kdtree(kdtree, faces, &face_idx);
+		break;
+
+	case KDBUILD_BINNED:
+		printf("  binned SAH with %d bins per axis\n", accel_param[ACCEL_PARAM_NUM_BINS]);
+		kdtree->cost = sah_cost(kdtree->aabb, num_faces);
+		res = build_kdtree_binned(kdtree, faces, &face_idx);
+		break;
+
+	case KDBUILD_SWEEP:
+	default:
+		kdtree->cost = sah_cost(kdtree->aabb, num_faces);
+		{
+			if(accel_param[ACCEL_PARAM_PERFECT_SPLITS]) {
+				printf("  perfect splits\n");
+			}
+
+			SweepState st;
+			st.face_idx.swap(face_idx);
+			init_sweep_state(faces, num_faces, &st);
+
+			res = build_kdtree_sweep(kdtree, faces, &st);
+		}
+		break;
+	}
+
+	tpool_destroy(build_pool);
+	build_pool = 0;
+	delete [] scratch_pools;
+	scratch_pools = 0;
+	build_arena = 0;
 
-	// now proceed splitting the root recursively
-	if(!::build_kdtree(kdtree, faces)) {
+	if(!res) {
 		fprintf(stderr, "failed to build kdtree\n");
 		return false;
 	}
 
 	printf("  tree depth: %d\n", kdtree_depth(kdtree));
+	printf("  build time: %ld msec\n", get_msec() - start_time);
+	printf("  tree memory: %lu kb\n", (unsigned long)(kdarena.get_size() / 1024));
 	print_item_counts(kdtree, 0);
+
+	if(kdcache_fname) {
+		if(kdtree_dump(kdtree, kdcache_fname, cache_key)) {
+			printf("  saved to cache: %s\n", kdcache_fname);
+		} else {
+			fprintf(stderr, "failed to save the kdtree cache: %s\n", kdcache_fname);
+		}
+	}
 	return true;
 }
 
@@ -384,15 +838,16 @@ struct Split {
 	float pos;
 	float sum_cost;
 	float cost_left, cost_right;
+	bool planar_left;	// faces lying on the splitting plane go to the left child
 };
 
-static void find_best_split(const KDNode *node, int axis, const Face *faces, Split *split)
+static void find_best_split(const KDNode *node, const std::vector<int> &face_idx, int axis, const Face *faces, Split *split)
 {
 	Split best_split;
 	best_split.sum_cost = FLT_MAX;
 
-	for(size_t i=0; i<node->face_idx.size(); i++) {
-		const Face *face = faces + node->face_idx[i];
+	for(size_t i=0; i<face_idx.size(); i++) {
+		const Face *face = faces + face_idx[i];
 
 		float splitpt[2];
 		splitpt[0] = MIN(face->v[0].pos[axis], MIN(face->v[1].pos[axis], face->v[2].pos[axis]));
@@ -408,8 +863,8 @@ static void find_best_split(const KDNode *node, int axis, const Face *faces, Spl
 			aabb_left.max[axis] = splitpt[j];
 			aabb_right.min[axis] = splitpt[j];
 
-			float left_cost = eval_cost(faces, &node->face_idx[0], node->face_idx.size(), aabb_left, axis);
-			float right_cost = eval_cost(faces, &node->face_idx[0], node->face_idx.size(), aabb_right, axis);
+			float left_cost = eval_cost(faces, &face_idx[0], face_idx.size(), aabb_left, axis);
+			float right_cost = eval_cost(faces, &face_idx[0], face_idx.size(), aabb_right, axis);
 			float sum_cost = left_cost + right_cost - accel_param[ACCEL_PARAM_COST_TRAVERSE]; // tcost is added twice
 
 			if(sum_cost < best_split.sum_cost) {
@@ -426,13 +881,13 @@ static void find_best_split(const KDNode *node, int axis, const Face *faces, Spl
 	split->axis = axis;
 }
 
-static bool build_kdtree(KDNode *kd, const Face *faces, int level)
+static bool build_kdtree(KDNode *kd, const Face *faces, std::vector<int> *face_idx, int level)
 {
 	int opt_max_depth = accel_param[ACCEL_PARAM_MAX_TREE_DEPTH];
 	int opt_max_items = accel_param[ACCEL_PARAM_MAX_NODE_ITEMS];
 
-	if(kd->face_idx.empty() || level >= opt_max_depth) {
-		return true;
+	if(face_idx->empty() || level >= opt_max_depth) {
+		return make_leaf(kd, *face_idx);
 	}
 
 	Split best_split;
@@ -441,7 +896,7 @@ static bool build_kdtree(KDNode *kd, const Face *faces, int level)
 
 	for(int i=0; i<3; i++) {
 		Split split;
-		find_best_split(kd, i, faces, &split);
+		find_best_split(kd, *face_idx, i, faces, &split);
 
 		if(split.sum_cost < best_split.sum_cost) {
 			best_split = split;
@@ -449,20 +904,22 @@ static bool build_kdtree(KDNode *kd, const Face *faces, int level)
 	}
 
 	if(best_split.axis == -1) {
-		return true;	// can't split any more, only 0-area splits available
+		return make_leaf(kd, *face_idx);	// can't split any more, only 0-area splits available
 	}
 
 	//printf("current cost: %f,   best_cost: %f\n", kd->cost, best_sum_cost);
-	if(best_split.sum_cost > kd->cost && (opt_max_items == 0 || (int)kd->face_idx.size() <= opt_max_items)) {
-		return true;	// stop splitting if it doesn't reduce the cost
+	if(best_split.sum_cost > kd->cost && (opt_max_items == 0 || (int)face_idx->size() <= opt_max_items)) {
+		return make_leaf(kd, *face_idx);	// stop splitting if it doesn't reduce the cost
 	}
 
 	kd->axis = best_split.axis;
 
 	// create the two children
 	KDNode *kdleft, *kdright;
-	kdleft = new KDNode;
-	kdright = new KDNode;
+	if(!(kdleft = alloc_node()) || !(kdright = alloc_node())) {
+		return false;
+	}
+	std::vector<int> left_idx, right_idx;
 
 	kdleft->aabb = kdright->aabb = kd->aabb;
 
@@ -473,130 +930,1006 @@ static bool build_kdtree(KDNode *kd, const Face *faces, int level)
 	kdright->cost = best_split.cost_right;
 
 	// TODO would it be much better if we actually split faces that straddle the splitting plane?
-	for(size_t i=0; i<kd->face_idx.size(); i++) {
-		int fidx = kd->face_idx[i];
+	for(size_t i=0; i<face_idx->size(); i++) {
+		int fidx = (*face_idx)[i];
 		const Face *face = faces + fidx;
 
 		if(face->v[0].pos[kd->axis] < best_split.pos ||
 				face->v[1].pos[kd->axis] < best_split.pos ||
 				face->v[2].pos[kd->axis] < best_split.pos) {
-			kdleft->face_idx.push_back(fidx);
+			left_idx.push_back(fidx);
 		}
 		if(face->v[0].pos[kd->axis] >= best_split.pos ||
 				face->v[1].pos[kd->axis] >= best_split.pos ||
 				face->v[2].pos[kd->axis] >= best_split.pos) {
-			kdright->face_idx.push_back(fidx);
+			right_idx.push_back(fidx);
 		}
 	}
-	kd->face_idx.clear();	// only leaves have faces
+	std::vector<int>().swap(*face_idx);	// only leaves have faces
 
 	kd->left = kdleft;
 	kd->right = kdright;
 
-	return build_kdtree(kd->left, faces, level + 1) && build_kdtree(kd->right, faces, level + 1);
+	return build_kdtree(kd->left, faces, &left_idx, level + 1) && build_kdtree(kd->right, faces, &right_idx, level + 1);
 }
 
-static float eval_cost(const Face *faces, const int *face_idx, int num_faces, const AABBox &aabb, int axis)
+static void add_split_events(std::vector<SplitEvent> *events, float fmin, float fmax, int face)
 {
-	int num_inside = 0;
-	int tcost = accel_param[ACCEL_PARAM_COST_TRAVERSE];
-	int icost = accel_param[ACCEL_PARAM_COST_INTERSECT];
+	SplitEvent ev;
+	ev.face = face;
+
+	if(fmin == fmax) {
+		ev.pos = fmin;
+		ev.type = EV_PLANAR;
+		events->push_back(ev);
+	} else {
+		ev.pos = fmin;
+		ev.type = EV_START;
+		events->push_back(ev);
+		ev.pos = fmax;
+		ev.type = EV_END;
+		events->push_back(ev);
+	}
+}
+
+struct InitEventsData {
+	const Face *faces;
+	int num_faces;
+	SweepState *st;
+};
+
+static void init_axis_events(int axis, void *data)
+{
+	InitEventsData *ctx = (InitEventsData*)data;
+	const Face *faces = ctx->faces;
+	int num_faces = ctx->num_faces;
+	std::vector<SplitEvent> *events = ctx->st->events + axis;
+
+	events->clear();
+	events->reserve(num_faces * 2);
 
 	for(int i=0; i<num_faces; i++) {
-		const Face *face = faces + face_idx[i];
+		const Face *face = faces + i;
+		float fmin = MIN(face->v[0].pos[axis], MIN(face->v[1].pos[axis], face->v[2].pos[axis]));
+		float fmax = MAX(face->v[0].pos[axis], MAX(face->v[1].pos[axis], face->v[2].pos[axis]));
 
-		for(int j=0; j<3; j++) {
-			if(face->v[j].pos[axis] >= aabb.min[axis] && face->v[j].pos[axis] < aabb.max[axis]) {
-				num_inside++;
-				break;
-			}
-		}
+		add_split_events(events, fmin, fmax, i);
 	}
 
-	float dx = aabb.max[0] - aabb.min[0];
-	float dy = aabb.max[1] - aabb.min[1];
-	float dz = aabb.max[2] - aabb.min[2];
+	std::sort(events->begin(), events->end());
+}
 
-	if(dx < 0.0) {
-		fprintf(stderr, "FOO DX = %f\n", dx);
-		abort();
-	}
-	if(dy < 0.0) {
-		fprintf(stderr, "FOO DX = %f\n", dy);
-		abort();
-	}
-	if(dz < 0.0) {
-		fprintf(stderr, "FOO DX = %f\n", dz);
-		abort();
-	}
+// the root's face_idx is the identity, so face numbers double as local indices
+static void init_sweep_state(const Face *faces, int num_faces, SweepState *st)
+{
+	InitEventsData ctx = {faces, num_faces, st};
+	run_per_axis(init_axis_events, &ctx, true);
 
-	if(dx < 1e-6 || dy < 1e-6 || dz < 1e-6) {
-		return FLT_MAX;	// heavily penalize 0-area voxels
-	}
+	if(accel_param[ACCEL_PARAM_PERFECT_SPLITS]) {
+		st->bounds.resize(num_faces);
 
-	float sarea = 2.0 * (dx + dy + dz);//aabb.calc_surface_area();
-	return tcost + sarea * num_inside * icost;
+		for(int i=0; i<num_faces; i++) {
+			calc_face_bounds(faces[i], &st->bounds[i]);
+		}
+	}
 }
 
-static void free_kdtree(KDNode *node)
+static void sweep_best_split(const KDNode *node, int num_faces, int axis, const std::vector<SplitEvent> &events, Split *split)
 {
-	if(node) {
-		free_kdtree(node->left);
-		free_kdtree(node->right);
-		delete node;
+	int tcost = accel_param[ACCEL_PARAM_COST_TRAVERSE];
+
+	Split best_split;
+	best_split.sum_cost = FLT_MAX;
+
+	int num_left = 0;
+	int num_right = num_faces;
+
+	size_t i = 0, num_events = events.size();
+	while(i < num_events) {
+		float pos = events[i].pos;
+		int num_end = 0, num_planar = 0, num_start = 0;
+
+		while(i < num_events && events[i].pos == pos && events[i].type == EV_END) {
+			num_end++;
+			i++;
+		}
+		while(i < num_events && events[i].pos == pos && events[i].type == EV_PLANAR) {
+			num_planar++;
+			i++;
+		}
+		while(i < num_events && events[i].pos == pos && events[i].type == EV_START) {
+			num_start++;
+			i++;
+		}
+
+		num_right -= num_planar + num_end;
+
+		if(pos > node->aabb.min[axis] && pos < node->aabb.max[axis]) {
+			AABBox aabb_left, aabb_right;
+			aabb_left = aabb_right = node->aabb;
+			aabb_left.max[axis] = pos;
+			aabb_right.min[axis] = pos;
+
+			// try putting the faces lying on the plane on either side
+			for(int j=0; j<2; j++) {
+				bool planar_left = j == 0;
+				float left_cost = sah_cost(aabb_left, num_left + (planar_left ? num_planar : 0));
+				float right_cost = sah_cost(aabb_right, num_right + (planar_left ? 0 : num_planar));
+				float sum_cost = left_cost + right_cost - tcost;	// tcost is added twice
+
+				if(sum_cost < best_split.sum_cost) {
+					best_split.cost_left = left_cost;
+					best_split.cost_right = right_cost;
+					best_split.sum_cost = sum_cost;
+					best_split.pos = pos;
+					best_split.planar_left = planar_left;
+				}
+
+				if(!num_planar) break;
+			}
+		}
+
+		num_left += num_start + num_planar;
 	}
+
+	assert(split);
+	*split = best_split;
+	split->axis = axis;
 }
 
-int kdtree_depth(const KDNode *node)
+// returns which children (SIDE_LEFT | SIDE_RIGHT) an extent along the split axis belongs to
+static int extent_side(float fmin, float fmax, const Split &split)
 {
-	if(!node) return 0;
+	if(fmin == split.pos && fmax == split.pos) {
+		return split.planar_left ? SIDE_LEFT : SIDE_RIGHT;
+	}
 
-	int left = kdtree_depth(node->left);
-	int right = kdtree_depth(node->right);
-	return (left > right ? left : right) + 1;
+	int side = 0;
+	if(fmin < split.pos) side |= SIDE_LEFT;
+	if(fmax > split.pos) side |= SIDE_RIGHT;
+	return side;
 }
 
-int kdtree_nodes(const KDNode *node)
+static int face_side(const Face *face, const Split &split)
 {
-	if(!node) return 0;
-	return kdtree_nodes(node->left) + kdtree_nodes(node->right) + 1;
+	int axis = split.axis;
+	float fmin = MIN(face->v[0].pos[axis], MIN(face->v[1].pos[axis], face->v[2].pos[axis]));
+	float fmax = MAX(face->v[0].pos[axis], MAX(face->v[1].pos[axis], face->v[2].pos[axis]));
+
+	return extent_side(fmin, fmax, split);
 }
 
-static void print_item_counts(const KDNode *node, int level)
+/* creates the children of a node and distributes its faces according to side[].
+ * The faces of the left child are compacted in place in face_idx, the faces of
+ * the right child are appended to right_idx.
+ */
+static bool split_node(KDNode *kd, const Split &split, std::vector<int> *face_idx,
+		const unsigned char *side, std::vector<int> *right_idx)
 {
-	if(!node) return;
+	kd->axis = split.axis;
 
-	for(int i=0; i<level; i++) {
-		fputs("   ", stdout);
+	KDNode *kdleft, *kdright;
+	if(!(kdleft = alloc_node()) || !(kdright = alloc_node())) {
+		return false;
 	}
-	printf("- %d (cost: %f)\n", (int)node->face_idx.size(), node->cost);
 
-	print_item_counts(node->left, level + 1);
-	print_item_counts(node->right, level + 1);
-}
+	kdleft->aabb = kdright->aabb = kd->aabb;
 
-#define SGN(x)		((x) >= 0 ? 1 : -1)
-#define INSIDE(x)	(SGN((x) - (splitpos)) == sign)
-#define OUTSIDE(x)	(!INSIDE(x))
+	kdleft->aabb.max[kd->axis] = split.pos;
+	kdright->aabb.min[kd->axis] = split.pos;
 
-#define LERPV3(res, a, b, t) \
-	do { \
-		(res)[0] = (a)[0] + ((b)[0] - (a)[0]) * (t); \
-		(res)[1] = (a)[1] + ((b)[1] - (a)[1]) * (t); \
-		(res)[2] = (a)[2] + ((b)[2] - (a)[2]) * (t); \
-	} while(0)
+	kdleft->cost = split.cost_left;
+	kdright->cost = split.cost_right;
 
-#define NORMALIZE(v)	\
-	do { \
-		float mag = (float)sqrt((v)[0] * (v)[0] + (v)[1] * (v)[1] + (v)[2] * (v)[2]); \
-		(v)[0] /= mag; \
-		(v)[1] /= mag; \
-		(v)[2] /= mag; \
-	} while(0)
+	size_t num_left = 0;
+	for(size_t i=0; i<face_idx->size(); i++) {
+		int fidx = (*face_idx)[i];
 
-static int clip_face(const Face &inface, float splitpos, int axis, int sign, Face *faces)
-{
-	assert(axis >= 0 && axis < 3);
+		if(side[i] & SIDE_LEFT) {
+			(*face_idx)[num_left++] = fidx;
+		}
+		if(side[i] & SIDE_RIGHT) {
+			right_idx->push_back(fidx);
+		}
+	}
+	face_idx->resize(num_left);
+
+	kd->left = kdleft;
+	kd->right = kdright;
+	return true;
+}
+
+struct SweepData {
+	const KDNode *node;
+	SweepState *st;
+	Split split[3];
+
+	// used while distributing the events to the children
+	int num_faces;
+	bool perfect;
+	const unsigned char *side;
+	const int *left_map, *right_map;
+	SweepState *st_left, *st_right;
+};
+
+static void sweep_axis(int axis, void *data)
+{
+	SweepData *ctx = (SweepData*)data;
+	sweep_best_split(ctx->node, ctx->num_faces, axis, ctx->st->events[axis], ctx->split + axis);
+}
+
+/* distribute the events to the children, renumbering the faces to the
+ * children's face_idx. Copying preserves their order, but clipped faces get
+ * new events which have to be sorted and merged in. The left child's events
+ * are compacted in place and take over the parent's list.
+ */
+static void distribute_axis_events(int axis, void *data)
+{
+	SweepData *ctx = (SweepData*)data;
+	std::vector<SplitEvent> &events = ctx->st->events[axis];
+	std::vector<SplitEvent> &events_left = ctx->st_left->events[axis];
+	std::vector<SplitEvent> &events_right = ctx->st_right->events[axis];
+	const unsigned char *side = ctx->side;
+
+	get_scratch(&cur_scratch_pool()->events, &events_right);
+	events_right.reserve(ctx->st_right->face_idx.size() * 2);
+
+	size_t num_left = 0;
+	for(size_t i=0; i<events.size(); i++) {
+		int fidx = events[i].face;
+		if(side[fidx] & SIDE_CLIPPED) {
+			continue;
+		}
+
+		SplitEvent ev = events[i];
+		if(side[fidx] & SIDE_RIGHT) {
+			ev.face = ctx->right_map[fidx];
+			events_right.push_back(ev);
+		}
+		if(side[fidx] & SIDE_LEFT) {
+			ev.face = ctx->left_map[fidx];
+			events[num_left++] = ev;
+		}
+	}
+	events.resize(num_left);
+	events_left.swap(events);
+
+	if(!ctx->perfect) {
+		return;
+	}
+
+	std::vector<SplitEvent> clipped_left, clipped_right;
+
+	for(int i=0; i<ctx->num_faces; i++) {
+		if(!(side[i] & SIDE_CLIPPED)) {
+			continue;
+		}
+
+		if(side[i] & SIDE_LEFT) {
+			const AABBox &box = ctx->st_left->bounds[ctx->left_map[i]];
+			add_split_events(&clipped_left, box.min[axis], box.max[axis], ctx->left_map[i]);
+		}
+		if(side[i] & SIDE_RIGHT) {
+			const AABBox &box = ctx->st_right->bounds[ctx->right_map[i]];
+			add_split_events(&clipped_right, box.min[axis], box.max[axis], ctx->right_map[i]);
+		}
+	}
+
+	merge_split_events(&events_left, &clipped_left);
+	merge_split_events(&events_right, &clipped_right);
+}
+
+static void merge_split_events(std::vector<SplitEvent> *events, std::vector<SplitEvent> *newev)
+{
+	if(newev->empty()) {
+		return;
+	}
+	std::sort(newev->begin(), newev->end());
+
+	ScratchPool *pool = cur_scratch_pool();
+
+	std::vector<SplitEvent> res;
+	get_scratch(&pool->events, &res);
+	res.resize(events->size() + newev->size());
+
+	std::merge(events->begin(), events->end(), newev->begin(), newev->end(), res.begin());
+	events->swap(res);
+	put_scratch(&pool->events, &res);
+}
+
+struct SweepSubtree {
+	KDNode *node;
+	const Face *faces;
+	SweepState st;
+	int level;
+	bool res;
+};
+
+static void sweep_subtree_task(void *cls)
+{
+	SweepSubtree *sub = (SweepSubtree*)cls;
+	sub->res = build_kdtree_sweep(sub->node, sub->faces, &sub->st, sub->level);
+}
+
+// turns a node of the sweep builder into a leaf, returning its lists to the pool
+static bool make_sweep_leaf(KDNode *kd, SweepState *st)
+{
+	bool res = make_leaf(kd, st->face_idx);
+
+	ScratchPool *pool = cur_scratch_pool();
+	put_scratch(&pool->idx, &st->face_idx);
+	for(int i=0; i<3; i++) {
+		put_scratch(&pool->events, st->events + i);
+	}
+	std::vector<AABBox>().swap(st->bounds);
+	return res;
+}
+
+static bool build_kdtree_sweep(KDNode *kd, const Face *faces, SweepState *st, int level)
+{
+	int opt_max_depth = accel_param[ACCEL_PARAM_MAX_TREE_DEPTH];
+	int opt_max_items = accel_param[ACCEL_PARAM_MAX_NODE_ITEMS];
+
+	if(st->face_idx.empty() || level >= opt_max_depth) {
+		return make_sweep_leaf(kd, st);
+	}
+
+	int num_faces = (int)st->face_idx.size();
+	bool par_axes = num_faces >= PAR_SPLIT_MIN_FACES;
+	bool perfect = !st->bounds.empty();
+
+	SweepData ctx;
+	ctx.node = kd;
+	ctx.st = st;
+	ctx.num_faces = num_faces;
+	run_per_axis(sweep_axis, &ctx, par_axes);
+
+	// pick the best split in axis order, so that ties resolve the same way regardless of threading
+	Split best_split;
+	best_split.axis = -1;
+	best_split.sum_cost = FLT_MAX;
+
+	for(int i=0; i<3; i++) {
+		if(ctx.split[i].sum_cost < best_split.sum_cost) {
+			best_split = ctx.split[i];
+		}
+	}
+
+	if(best_split.axis == -1) {
+		return make_sweep_leaf(kd, st);	// can't split any more, only 0-area splits available
+	}
+
+	if(best_split.sum_cost > kd->cost && (opt_max_items == 0 || num_faces <= opt_max_items)) {
+		return make_sweep_leaf(kd, st);	// stop splitting if it doesn't reduce the cost
+	}
+
+	int axis = best_split.axis;
+	std::vector<unsigned char> side(num_faces);
+	std::vector<AABBox> clip_left, clip_right;
+
+	if(perfect) {
+		AABBox vox_left = kd->aabb, vox_right = kd->aabb;
+		vox_left.max[axis] = best_split.pos;
+		vox_right.min[axis] = best_split.pos;
+
+		clip_left.resize(num_faces);
+		clip_right.resize(num_faces);
+
+		for(int i=0; i<num_faces; i++) {
+			const AABBox &box = st->bounds[i];
+			side[i] = extent_side(box.min[axis], box.max[axis], best_split);
+
+			if(side[i] != (SIDE_LEFT | SIDE_RIGHT)) {
+				continue;
+			}
+
+			/* the face straddles the plane, clip it to both children to find
+			 * out how much of each it actually covers (if any).
+			 */
+			const Face &face = faces[st->face_idx[i]];
+			side[i] |= SIDE_CLIPPED;
+
+			if(!clip_face_bounds(face, vox_left, &clip_left[i])) {
+				side[i] &= ~SIDE_LEFT;
+			}
+			if(!clip_face_bounds(face, vox_right, &clip_right[i])) {
+				side[i] &= ~SIDE_RIGHT;
+			}
+		}
+	} else {
+		for(int i=0; i<num_faces; i++) {
+			side[i] = face_side(faces + st->face_idx[i], best_split);
+		}
+	}
+
+	// local indices of the faces in the children's face_idx
+	std::vector<int> left_map(num_faces), right_map(num_faces);
+	int num_left = 0, num_right = 0;
+
+	for(int i=0; i<num_faces; i++) {
+		left_map[i] = side[i] & SIDE_LEFT ? num_left++ : -1;
+		right_map[i] = side[i] & SIDE_RIGHT ? num_right++ : -1;
+	}
+
+	SweepSubtree *left = new SweepSubtree;
+	left->faces = faces;
+	left->level = level + 1;
+	left->res = false;
+
+	SweepState st_right;
+
+	if(perfect) {
+		left->st.bounds.resize(num_left);
+		st_right.bounds.resize(num_right);
+
+		for(int i=0; i<num_faces; i++) {
+			bool clipped = side[i] & SIDE_CLIPPED;
+
+			if(side[i] & SIDE_LEFT) {
+				left->st.bounds[left_map[i]] = clipped ? clip_left[i] : st->bounds[i];
+			}
+			if(side[i] & SIDE_RIGHT) {
+				st_right.bounds[right_map[i]] = clipped ? clip_right[i] : st->bounds[i];
+			}
+		}
+		std::vector<AABBox>().swap(st->bounds);
+	}
+
+	get_scratch(&cur_scratch_pool()->idx, &st_right.face_idx);
+	st_right.face_idx.reserve(num_right);
+
+	if(!split_node(kd, best_split, &st->face_idx, &side[0], &st_right.face_idx)) {
+		delete left;
+		return false;
+	}
+	left->node = kd->left;
+	left->st.face_idx.swap(st->face_idx);
+
+	ctx.perfect = perfect;
+	ctx.side = &side[0];
+	ctx.left_map = &left_map[0];
+	ctx.right_map = &right_map[0];
+	ctx.st_left = &left->st;
+	ctx.st_right = &st_right;
+	run_per_axis(distribute_axis_events, &ctx, par_axes);
+
+	bool res;
+	if(build_pool && num_left >= PAR_SUBTREE_MIN_FACES && num_right >= PAR_SUBTREE_MIN_FACES) {
+		TaskGroup grp;
+		tpool_spawn(build_pool, &grp, sweep_subtree_task, left);
+		res = build_kdtree_sweep(kd->right, faces, &st_right, level + 1);
+		tpool_wait(build_pool, &grp);
+		res = left->res && res;
+	} else {
+		sweep_subtree_task(left);
+		res = left->res && build_kdtree_sweep(kd->right, faces, &st_right, level + 1);
+	}
+
+	delete left;
+	return res;
+}
+
+/* Binned SAH construction
+ * Approximates the sweep by only considering the boundaries of a fixed number
+ * of equally sized bins along each axis as candidate planes. Faces are counted
+ * into the bins containing the two ends of their extent, and a prefix sum over
+ * the bins gives the face counts on both sides of every boundary. No sorting
+ * is involved, so each node costs O(N + bins).
+ */
+static void binned_best_split(const KDNode *node, const std::vector<int> &face_idx, int axis, const Face *faces, Split *split)
+{
+	int tcost = accel_param[ACCEL_PARAM_COST_TRAVERSE];
+	int num_bins = accel_param[ACCEL_PARAM_NUM_BINS];
+	if(num_bins < 2) num_bins = 2;
+	if(num_bins > MAX_SAH_BINS) num_bins = MAX_SAH_BINS;
+
+	Split best_split;
+	best_split.sum_cost = FLT_MAX;
+
+	float bmin = node->aabb.min[axis];
+	float extent = node->aabb.max[axis] - bmin;
+
+	if(extent <= 0.0) {
+		*split = best_split;
+		split->axis = axis;
+		return;
+	}
+	float scale = (float)num_bins / extent;
+
+	int start_count[MAX_SAH_BINS], end_count[MAX_SAH_BINS];
+	memset(start_count, 0, num_bins * sizeof *start_count);
+	memset(end_count, 0, num_bins * sizeof *end_count);
+
+	for(size_t i=0; i<face_idx.size(); i++) {
+		const Face *face = faces + face_idx[i];
+		float fmin = MIN(face->v[0].pos[axis], MIN(face->v[1].pos[axis], face->v[2].pos[axis]));
+		float fmax = MAX(face->v[0].pos[axis], MAX(face->v[1].pos[axis], face->v[2].pos[axis]));
+
+		int bstart = (int)((fmin - bmin) * scale);
+		int bend = (int)((fmax - bmin) * scale);
+
+		start_count[bstart < 0 ? 0 : (bstart >= num_bins ? num_bins - 1 : bstart)]++;
+		end_count[bend < 0 ? 0 : (bend >= num_bins ? num_bins - 1 : bend)]++;
+	}
+
+	int num_faces = (int)face_idx.size();
+	int num_left = 0;
+	int num_right = num_faces;
+
+	for(int i=1; i<num_bins; i++) {
+		num_left += start_count[i - 1];
+		num_right -= end_count[i - 1];
+
+		if(num_left == num_faces && num_right == num_faces) {
+			continue;	// every face straddles this plane, splitting here is pointless
+		}
+
+		float pos = bmin + (float)i / scale;
+
+		AABBox aabb_left, aabb_right;
+		aabb_left = aabb_right = node->aabb;
+		aabb_left.max[axis] = pos;
+		aabb_right.min[axis] = pos;
+
+		float left_cost = sah_cost(aabb_left, num_left);
+		float right_cost = sah_cost(aabb_right, num_right);
+		float sum_cost = left_cost + right_cost - tcost;	// tcost is added twice
+
+		if(sum_cost < best_split.sum_cost) {
+			best_split.cost_left = left_cost;
+			best_split.cost_right = right_cost;
+			best_split.sum_cost = sum_cost;
+			best_split.pos = pos;
+			best_split.planar_left = false;	// planar faces were binned to the right
+		}
+	}
+
+	assert(split);
+	*split = best_split;
+	split->axis = axis;
+}
+
+struct BinnedData {
+	const KDNode *node;
+	const std::vector<int> *face_idx;
+	const Face *faces;
+	Split split[3];
+};
+
+static void binned_axis(int axis, void *data)
+{
+	BinnedData *ctx = (BinnedData*)data;
+	binned_best_split(ctx->node, *ctx->face_idx, axis, ctx->faces, ctx->split + axis);
+}
+
+struct BinnedSubtree {
+	KDNode *node;
+	const Face *faces;
+	std::vector<int> face_idx;
+	int level;
+	bool res;
+};
+
+static void binned_subtree_task(void *cls)
+{
+	BinnedSubtree *st = (BinnedSubtree*)cls;
+	st->res = build_kdtree_binned(st->node, st->faces, &st->face_idx, st->level);
+}
+
+// turns a node of the binned builder into a leaf, returning its list to the pool
+static bool make_binned_leaf(KDNode *kd, std::vector<int> *face_idx)
+{
+	bool res = make_leaf(kd, *face_idx);
+	put_scratch(&cur_scratch_pool()->idx, face_idx);
+	return res;
+}
+
+static bool build_kdtree_binned(KDNode *kd, const Face *faces, std::vector<int> *face_idx, int level)
+{
+	int opt_max_depth = accel_param[ACCEL_PARAM_MAX_TREE_DEPTH];
+	int opt_max_items = accel_param[ACCEL_PARAM_MAX_NODE_ITEMS];
+
+	if(face_idx->empty() || level >= opt_max_depth) {
+		return make_binned_leaf(kd, face_idx);
+	}
+
+	BinnedData ctx;
+	ctx.node = kd;
+	ctx.face_idx = face_idx;
+	ctx.faces = faces;
+	run_per_axis(binned_axis, &ctx, face_idx->size() >= PAR_SPLIT_MIN_FACES);
+
+	Split best_split;
+	best_split.axis = -1;
+	best_split.sum_cost = FLT_MAX;
+
+	for(int i=0; i<3; i++) {
+		if(ctx.split[i].sum_cost < best_split.sum_cost) {
+			best_split = ctx.split[i];
+		}
+	}
+
+	if(best_split.axis == -1) {
+		return make_binned_leaf(kd, face_idx);	// can't split any more, only 0-area splits available
+	}
+
+	if(best_split.sum_cost > kd->cost && (opt_max_items == 0 || (int)face_idx->size() <= opt_max_items)) {
+		return make_binned_leaf(kd, face_idx);	// stop splitting if it doesn't reduce the cost
+	}
+
+	std::vector<unsigned char> side(face_idx->size());
+	for(size_t i=0; i<face_idx->size(); i++) {
+		side[i] = face_side(faces + (*face_idx)[i], best_split);
+	}
+
+	std::vector<int> right_idx;
+	get_scratch(&cur_scratch_pool()->idx, &right_idx);
+
+	if(!split_node(kd, best_split, face_idx, &side[0], &right_idx)) {
+		return false;
+	}
+
+	BinnedSubtree left;
+	left.node = kd->left;
+	left.faces = faces;
+	left.face_idx.swap(*face_idx);
+	left.level = level + 1;
+	left.res = false;
+
+	if(build_pool && left.face_idx.size() >= PAR_SUBTREE_MIN_FACES &&
+			right_idx.size() >= PAR_SUBTREE_MIN_FACES) {
+		TaskGroup grp;
+		tpool_spawn(build_pool, &grp, binned_subtree_task, &left);
+		bool res = build_kdtree_binned(kd->right, faces, &right_idx, level + 1);
+		tpool_wait(build_pool, &grp);
+		return left.res && res;
+	}
+
+	binned_subtree_task(&left);
+	return left.res && build_kdtree_binned(kd->right, faces, &right_idx, level + 1);
+}
+
+static float eval_cost(const Face *faces, const int *face_idx, int num_faces, const AABBox &aabb, int axis)
+{
+	int num_inside = 0;
+
+	for(int i=0; i<num_faces; i++) {
+		const Face *face = faces + face_idx[i];
+
+		for(int j=0; j<3; j++) {
+			if(face->v[j].pos[axis] >= aabb.min[axis] && face->v[j].pos[axis] < aabb.max[axis]) {
+				num_inside++;
+				break;
+			}
+		}
+	}
+
+	return sah_cost(aabb, num_inside);
+}
+
+static float sah_cost(const AABBox &aabb, int num_faces)
+{
+	int tcost = accel_param[ACCEL_PARAM_COST_TRAVERSE];
+	int icost = accel_param[ACCEL_PARAM_COST_INTERSECT];
+
+	float dx = aabb.max[0] - aabb.min[0];
+	float dy = aabb.max[1] - aabb.min[1];
+	float dz = aabb.max[2] - aabb.min[2];
+
+	if(dx < 0.0) {
+		fprintf(stderr, "FOO DX = %f\n", dx);
+		abort();
+	}
+	if(dy < 0.0) {
+		fprintf(stderr, "FOO DX = %f\n", dy);
+		abort();
+	}
+	if(dz < 0.0) {
+		fprintf(stderr, "FOO DX = %f\n", dz);
+		abort();
+	}
+
+	if(dx < 1e-6 || dy < 1e-6 || dz < 1e-6) {
+		return FLT_MAX;	// heavily penalize 0-area voxels
+	}
+
+	float sarea = 2.0 * (dx + dy + dz);//aabb.calc_surface_area();
+	return tcost + sarea * num_faces * icost;
+}
+
+int kdtree_depth(const KDNode *node)
+{
+	if(!node) return 0;
+
+	int left = kdtree_depth(node->left);
+	int right = kdtree_depth(node->right);
+	return (left > right ? left : right) + 1;
+}
+
+int kdtree_nodes(const KDNode *node)
+{
+	if(!node) return 0;
+	return kdtree_nodes(node->left) + kdtree_nodes(node->right) + 1;
+}
+
+static int count_leaf_items(const KDNode *node)
+{
+	if(!node) return 0;
+	return node->num_faces + count_leaf_items(node->left) + count_leaf_items(node->right);
+}
+
+static void print_item_counts(const KDNode *node, int level)
+{
+	if(!node) return;
+
+	for(int i=0; i<level; i++) {
+		fputs("   ", stdout);
+	}
+	printf("- %d (cost: %f)\n", node->num_faces, node->cost);
+
+	print_item_counts(node->left, level + 1);
+	print_item_counts(node->right, level + 1);
+}
+
+/* kd-tree cache file format (native byte order)
+ * The header is followed by the nodes in depth-first order, 12 bytes each,
+ * and then the face indices of all the leaves in the same order. The bounds
+ * of the nodes are recreated from the root bounds and the split planes, the
+ * same way the builders derive them.
+ */
+#define KDTREE_FILE_MAGIC	"CLRAYKDT"
+#define KDTREE_FILE_VERSION	1
+
+struct KDFileHeader {
+	char magic[8];
+	int32_t version;
+	uint64_t key;
+	int32_t num_nodes;
+	int32_t num_refs;
+	float root_min[3], root_max[3];
+};
+
+struct KDFileNode {
+	int32_t axis;		// -1 for leaves
+	union {
+		float pos;			// split position of interior nodes
+		int32_t num_faces;	// face count of leaves
+	};
+	float cost;
+};
+
+static void hash_words(uint64_t *hash, const void *data, size_t num_words)
+{
+	const uint32_t *ptr = (const uint32_t*)data;
+
+	// FNV-1a over 32bit words
+	for(size_t i=0; i<num_words; i++) {
+		*hash = (*hash ^ ptr[i]) * 1099511628211ULL;
+	}
+}
+
+/* The tree only depends on the vertex positions and the parameters that affect
+ * split selection. The number of construction threads doesn't matter since
+ * the builders are deterministic.
+ */
+uint64_t kdtree_cache_key(const Face *faces, int num_faces)
+{
+	uint64_t hash = 14695981039346656037ULL;
+
+	int32_t hdr[2] = {KDTREE_FILE_VERSION, num_faces};
+	hash_words(&hash, hdr, 2);
+
+	for(int i=0; i<num_faces; i++) {
+		for(int j=0; j<3; j++) {
+			hash_words(&hash, faces[i].v[j].pos, 3);
+		}
+	}
+
+	static const int key_params[] = {
+		ACCEL_PARAM_MAX_TREE_DEPTH, ACCEL_PARAM_MAX_NODE_ITEMS,
+		ACCEL_PARAM_COST_TRAVERSE, ACCEL_PARAM_COST_INTERSECT,
+		ACCEL_PARAM_BUILD_METHOD, ACCEL_PARAM_NUM_BINS,
+		ACCEL_PARAM_PERFECT_SPLITS
+	};
+	for(size_t i=0; i<sizeof key_params / sizeof *key_params; i++) {
+		int32_t val = accel_param[key_params[i]];
+		hash_words(&hash, &val, 1);
+	}
+	return hash;
+}
+
+static void flatten_file_nodes(const KDNode *node, std::vector<KDFileNode> *nodes, std::vector<int32_t> *refs)
+{
+	KDFileNode fnode;
+	fnode.cost = node->cost;
+
+	if(node->left) {
+		fnode.axis = node->axis;
+		fnode.pos = node->left->aabb.max[node->axis];
+		nodes->push_back(fnode);
+
+		flatten_file_nodes(node->left, nodes, refs);
+		flatten_file_nodes(node->right, nodes, refs);
+	} else {
+		fnode.axis = -1;
+		fnode.num_faces = node->num_faces;
+		nodes->push_back(fnode);
+
+		refs->insert(refs->end(), node->face_idx, node->face_idx + node->num_faces);
+	}
+}
+
+bool kdtree_dump(const KDNode *tree, const char *fname, uint64_t key)
+{
+	std::vector<KDFileNode> nodes;
+	std::vector<int32_t> refs;
+	flatten_file_nodes(tree, &nodes, &refs);
+
+	KDFileHeader hdr;
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, KDTREE_FILE_MAGIC, sizeof hdr.magic);
+	hdr.version = KDTREE_FILE_VERSION;
+	hdr.key = key;
+	hdr.num_nodes = (int32_t)nodes.size();
+	hdr.num_refs = (int32_t)refs.size();
+	for(int i=0; i<3; i++) {
+		hdr.root_min[i] = tree->aabb.min[i];
+		hdr.root_max[i] = tree->aabb.max[i];
+	}
+
+	FILE *fp;
+	if(!(fp = fopen(fname, "wb"))) {
+		return false;
+	}
+
+	bool res = fwrite(&hdr, sizeof hdr, 1, fp) == 1 &&
+		fwrite(&nodes[0], sizeof nodes[0], nodes.size(), fp) == nodes.size() &&
+		(refs.empty() || fwrite(&refs[0], sizeof refs[0], refs.size(), fp) == refs.size());
+
+	if(fclose(fp) != 0) {
+		res = false;
+	}
+	if(!res) {
+		remove(fname);	// don't leave a truncated file around
+	}
+	return res;
+}
+
+struct KDRestore {
+	const KDFileHeader *hdr;
+	const KDFileNode *nodes;
+	const int32_t *refs;
+	int num_faces;
+	int next_node, next_ref;
+	Arena *arena;
+};
+
+static KDNode *restore_node(KDRestore *rs, const AABBox &aabb, int level)
+{
+	if(rs->next_node >= rs->hdr->num_nodes || level > MAX_TREE_DEPTH * 4) {
+		return 0;
+	}
+	const KDFileNode *fnode = rs->nodes + rs->next_node++;
+
+	void *mem = rs->arena->alloc(sizeof(KDNode));
+	if(!mem) {
+		return 0;
+	}
+	KDNode *node = new(mem) KDNode;
+	node->aabb = aabb;
+	node->cost = fnode->cost;
+
+	if(fnode->axis < 0) {
+		int num_faces = fnode->num_faces;
+		if(num_faces < 0 || num_faces > rs->hdr->num_refs - rs->next_ref) {
+			return 0;
+		}
+
+		if(num_faces) {
+			if(!(node->face_idx = (int*)rs->arena->alloc(num_faces * sizeof *node->face_idx))) {
+				return 0;
+			}
+			for(int i=0; i<num_faces; i++) {
+				int fidx = rs->refs[rs->next_ref++];
+				if(fidx < 0 || fidx >= rs->num_faces) {
+					return 0;
+				}
+				node->face_idx[i] = fidx;
+			}
+		}
+		node->num_faces = num_faces;
+		return node;
+	}
+
+	if(fnode->axis > 2) {
+		return 0;
+	}
+	node->axis = fnode->axis;
+
+	AABBox aabb_left = aabb, aabb_right = aabb;
+	aabb_left.max[node->axis] = fnode->pos;
+	aabb_right.min[node->axis] = fnode->pos;
+
+	if(!(node->left = restore_node(rs, aabb_left, level + 1)) ||
+			!(node->right = restore_node(rs, aabb_right, level + 1))) {
+		return 0;
+	}
+	return node;
+}
+
+/* returns 0 if the file is missing, corrupt, or was built for different
+ * faces or parameters. Anything allocated from the arena on failure is
+ * reclaimed with the rest of the tree when it's released.
+ */
+KDNode *kdtree_restore(const char *fname, uint64_t key, int num_faces, Arena *arena)
+{
+	FILE *fp;
+	if(!(fp = fopen(fname, "rb"))) {
+		return 0;
+	}
+
+	KDFileHeader hdr;
+	if(fread(&hdr, sizeof hdr, 1, fp) != 1 || memcmp(hdr.magic, KDTREE_FILE_MAGIC, sizeof hdr.magic) != 0 ||
+			hdr.version != KDTREE_FILE_VERSION || hdr.key != key || hdr.num_nodes <= 0 || hdr.num_refs < 0) {
+		fclose(fp);
+		return 0;
+	}
+
+	std::vector<KDFileNode> nodes(hdr.num_nodes);
+	std::vector<int32_t> refs(hdr.num_refs);
+
+	bool res = fread(&nodes[0], sizeof nodes[0], nodes.size(), fp) == nodes.size() &&
+		(refs.empty() || fread(&refs[0], sizeof refs[0], refs.size(), fp) == refs.size());
+	fclose(fp);
+
+	if(!res) {
+		return 0;
+	}
+
+	AABBox aabb;
+	for(int i=0; i<3; i++) {
+		aabb.min[i] = hdr.root_min[i];
+		aabb.max[i] = hdr.root_max[i];
+	}
+	aabb.min[3] = aabb.max[3] = 0.0;
+
+	KDRestore rs;
+	rs.hdr = &hdr;
+	rs.nodes = &nodes[0];
+	rs.refs = refs.empty() ? 0 : &refs[0];
+	rs.num_faces = num_faces;
+	rs.next_node = rs.next_ref = 0;
+	rs.arena = arena;
+
+	KDNode *tree = restore_node(&rs, aabb, 0);
+	if(!tree || rs.next_node != hdr.num_nodes || rs.next_ref != hdr.num_refs) {
+		return 0;
+	}
+	return tree;
+}
+
+#define SGN(x)		((x) >= 0 ? 1 : -1)
+#define INSIDE(x)	(SGN((x) - (splitpos)) == sign)
+#define OUTSIDE(x)	(!INSIDE(x))
+
+#define LERPV3(res, a, b, t) \
+	do { \
+		(res)[0] = (a)[0] + ((b)[0] - (a)[0]) * (t); \
+		(res)[1] = (a)[1] + ((b)[1] - (a)[1]) * (t); \
+		(res)[2] = (a)[2] + ((b)[2] - (a)[2]) * (t); \
+	} while(0)
+
+#define NORMALIZE(v)	\
+	do { \
+		float mag = (float)sqrt((v)[0] * (v)[0] + (v)[1] * (v)[1] + (v)[2] * (v)[2]); \
+		(v)[0] /= mag; \
+		(v)[1] /= mag; \
+		(v)[2] /= mag; \
+	} while(0)
+
+static int clip_face(const Face &inface, float splitpos, int axis, int sign, Face *faces)
+{
+	assert(axis >= 0 && axis < 3);
 
 	std::vector<Vertex> verts;
 	bool clipped = false;
@@ -687,6 +2020,77 @@ static int clip_face(const Face &inface, float splitpos, int axis, int sign, Fac
 	return 2;
 }
 
+static void calc_face_bounds(const Face &face, AABBox *bounds)
+{
+	for(int i=0; i<3; i++) {
+		bounds->min[i] = MIN(face.v[0].pos[i], MIN(face.v[1].pos[i], face.v[2].pos[i]));
+		bounds->max[i] = MAX(face.v[0].pos[i], MAX(face.v[1].pos[i], face.v[2].pos[i]));
+	}
+	bounds->min[3] = bounds->max[3] = 0.0;
+}
+
+/* Clips a face against the planes of a voxel with clip_face, and returns the
+ * bounds of what's left inside it, or false if nothing is. Only the planes
+ * actually crossed by the face are used, so that faces lying on the boundary
+ * of the voxel are kept.
+ */
+static bool clip_face_bounds(const Face &face, const AABBox &voxel, AABBox *bounds)
+{
+	std::vector<Face> polys(1, face), clipped;
+	AABBox fbox;
+	calc_face_bounds(face, &fbox);
+
+	for(int axis=0; axis<3; axis++) {
+		for(int j=0; j<2; j++) {
+			int sign = j == 0 ? 1 : -1;
+			float splitpos = j == 0 ? voxel.min[axis] : voxel.max[axis];
+
+			if(sign > 0 ? fbox.min[axis] >= splitpos : fbox.max[axis] <= splitpos) {
+				continue;
+			}
+
+			clipped.clear();
+			for(size_t i=0; i<polys.size(); i++) {
+				Face res[2];
+				int num = clip_face(polys[i], splitpos, axis, sign, res);
+
+				if(num) {
+					clipped.insert(clipped.end(), res, res + num);
+				} else if(INSIDE(polys[i].v[0].pos[axis])) {
+					clipped.push_back(polys[i]);	// entirely inside this plane
+				}
+			}
+			polys.swap(clipped);
+
+			if(polys.empty()) {
+				return false;
+			}
+		}
+	}
+
+	calc_face_bounds(polys[0], bounds);
+	for(size_t i=1; i<polys.size(); i++) {
+		AABBox box;
+		calc_face_bounds(polys[i], &box);
+
+		for(int j=0; j<3; j++) {
+			bounds->min[j] = MIN(bounds->min[j], box.min[j]);
+			bounds->max[j] = MAX(bounds->max[j], box.max[j]);
+		}
+	}
+
+	// don't let rounding push the bounds out of the voxel
+	for(int i=0; i<3; i++) {
+		bounds->min[i] = MAX(bounds->min[i], voxel.min[i]);
+		bounds->max[i] = MIN(bounds->max[i], voxel.max[i]);
+
+		if(bounds->min[i] > bounds->max[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
 static float calc_sq_area(const Vector3 &a, const Vector3 &b, const Vector3 &c)
 {
 	Vector3 v1 = b - a;
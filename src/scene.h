@@ -2,9 +2,11 @@
 #define MESH_H_
 
 #include <stdio.h>
+#include <stdint.h>
 #include <vector>
 #include <list>
 #include "common.h"
+#include "arena.h"
 
 struct Vertex {
 	float pos[4];
@@ -20,6 +22,24 @@ struct Face {
 	int padding[3];
 };
 
+/* per-face intersection record: the first vertex and the two edges leaving it,
+ * precomputed from the face buffer for the Moller-Trumbore ray-triangle test.
+ */
+struct TriAccel {
+	float v0[4];
+	float e1[4], e2[4];
+};
+
+/* the part of a face which is only needed for shading a hit, kept apart from
+ * the positions so that traversal doesn't drag it through the cache.
+ */
+struct FaceShading {
+	float normal[3][4];	// vertex normals
+	float tex[3][2];
+	int matid;
+	int padding;
+};
+
 struct Material {
 	float kd[4], ks[4];
 	float kr, kt;
@@ -49,26 +69,61 @@ struct KDNode {
 	float cost;
 
 	KDNode *left, *right;
-	std::vector<int> face_idx;
+	int *face_idx;	// faces of leaf nodes, allocated along with the tree
+	int num_faces;
 
 	KDNode();
 };
 
+/* compact (8 byte) flattened kd-tree node. The low 2 bits of info are the
+ * split axis, or KDNODE_LEAF. The rest is the index of the left child for
+ * interior nodes, whose right child always comes right after it, or the number
+ * of faces for leaves. The faces of a leaf are consecutive entries of the leaf
+ * buffer (see Scene::get_kdtree_leaf_buffer), starting at face_offset.
+ * Children are stored in pairs starting at even indices, so the root is
+ * followed by an unused node.
+ */
 struct KDNodeGPU {
-	AABBox aabb;
-	int face_idx[MAX_NODE_FACES];
-	int num_faces;
-	int left, right;
-	int padding;
+	union {
+		float split;
+		unsigned int face_offset;
+	};
+	unsigned int info;
+};
+
+/* leaf of the flattened kd-tree with ropes, for stackless traversal: its
+ * bounds, and the node on the other side of each of its faces, -1 for faces
+ * on the boundary of the tree. In the nodes which go with them (see
+ * Scene::get_kdtree_rope_nodes) face_offset of each leaf is replaced by the
+ * index of its KDLeafGPU.
+ */
+struct KDLeafGPU {
+	float min[3];
+	unsigned int face_offset;
+	float max[3];
+	unsigned int num_faces;
+	int rope[6];	// -X, +X, -Y, +Y, -Z, +Z
+	int padding[2];
 };
 
 
 class Scene {
 private:
 	mutable Face *facebuf;
+	mutable TriAccel *tribuf;
+	mutable FaceShading *shadebuf;
 	mutable int num_faces;
 
 	mutable KDNodeGPU *kdbuf;
+	mutable int kdbuf_size;
+	mutable int *kdleafbuf;
+	mutable int kdleafbuf_size;
+	mutable KDNodeGPU *kdropenodes;
+	mutable KDLeafGPU *kdropebuf;
+	mutable int kdropebuf_size;
+
+	Arena kdarena;	// holds the nodes and leaf face lists of kdtree
+	char *kdcache_fname;
 
 public:
 	std::vector<Mesh*> meshes;
@@ -87,6 +142,9 @@ public:
 	int get_num_faces() const;
 	int get_num_materials() const;
 	int get_num_kdnodes() const;
+	int get_kdtree_buffer_size() const;
+	int get_num_kdtree_leaf_items() const;
+	int get_num_kdtree_rope_leaves() const;
 
 	Mesh **get_meshes();
 	const Mesh * const *get_meshes() const;
@@ -101,7 +159,16 @@ public:
 	bool load(FILE *fp);
 
 	const Face *get_face_buffer() const;
+	const TriAccel *get_tri_accel_buffer() const;
+	const FaceShading *get_face_shading_buffer() const;
 	const KDNodeGPU *get_kdtree_buffer() const;
+	const int *get_kdtree_leaf_buffer() const;
+	// same as get_kdtree_buffer, but the leaves point to get_kdtree_rope_buffer
+	const KDNodeGPU *get_kdtree_rope_nodes() const;
+	const KDLeafGPU *get_kdtree_rope_buffer() const;
+
+	// loads the kd-tree from this file if it's still valid, otherwise saves it there
+	void set_kdtree_cache(const char *fname);
 
 	void draw_kdtree() const;
 	bool build_kdtree();
@@ -112,16 +179,31 @@ enum {
 	ACCEL_PARAM_MAX_NODE_ITEMS,
 	ACCEL_PARAM_COST_TRAVERSE,
 	ACCEL_PARAM_COST_INTERSECT,
+	ACCEL_PARAM_BUILD_METHOD,
+	ACCEL_PARAM_NUM_BINS,
+	ACCEL_PARAM_NUM_THREADS,
+	ACCEL_PARAM_PERFECT_SPLITS,
 
 	NUM_ACCEL_PARAMS
 };
 
+// kd-tree construction algorithms (values of ACCEL_PARAM_BUILD_METHOD)
+enum {
+	KDBUILD_NAIVE,	// O(N^2) per node, re-counts faces for every candidate plane
+	KDBUILD_SWEEP,	// O(N log N) sorted event sweep (default)
+	KDBUILD_BINNED	// O(N) per level, approximate SAH over ACCEL_PARAM_NUM_BINS bins
+};
+
 void set_accel_param(int p, int v);
 
 int kdtree_depth(const KDNode *tree);
 int kdtree_nodes(const KDNode *tree);
 
-bool kdtree_dump(const KDNode *tree, const char *fname);
-KDNode *kdtree_restore(const char *fname);
+/* kd-tree cache files. The key identifies the faces and construction
+ * parameters the tree was built from, and restoring fails unless it matches.
+ */
+uint64_t kdtree_cache_key(const Face *faces, int num_faces);
+bool kdtree_dump(const KDNode *tree, const char *fname, uint64_t key);
+KDNode *kdtree_restore(const char *fname, uint64_t key, int num_faces, Arena *arena);
 
 #endif	/* MESH_H_ */
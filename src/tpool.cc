@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include "tpool.h"
+
+TaskGroup::TaskGroup()
+{
+	pending = 0;
+}
+
+#if defined(unix) || defined(__unix__) || defined(__APPLE__)
+#include <deque>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+struct Task {
+	TaskFunc func;
+	void *cls;
+	TaskGroup *grp;
+};
+
+struct TaskQueue {
+	pthread_mutex_t lock;
+	std::deque<Task> tasks;
+};
+
+struct ThreadPool {
+	int num_threads;
+	pthread_t *threads;		// num_threads - 1 workers, the caller is the last one
+
+	TaskQueue *queues;		// one per thread, including the caller
+	volatile int num_queued;
+
+	pthread_mutex_t idle_lock;
+	pthread_cond_t idle_cond;
+	volatile bool quit;
+};
+
+struct WorkerInfo {
+	ThreadPool *tpool;
+	int idx;
+};
+
+static void *worker_func(void *arg);
+static int cur_queue(const ThreadPool *tpool);
+static bool get_task(ThreadPool *tpool, int self, Task *task);
+static void run_task(const Task &task);
+
+static pthread_key_t worker_key;
+static pthread_once_t worker_key_once = PTHREAD_ONCE_INIT;
+
+static void create_worker_key()
+{
+	pthread_key_create(&worker_key, 0);
+}
+
+ThreadPool *tpool_create(int num_threads)
+{
+	if(num_threads <= 0) {
+		num_threads = tpool_num_processors();
+	}
+	pthread_once(&worker_key_once, create_worker_key);
+
+	ThreadPool *tpool = new ThreadPool;
+	tpool->num_threads = num_threads;
+	tpool->num_queued = 0;
+	tpool->quit = false;
+
+	tpool->queues = new TaskQueue[num_threads];
+	for(int i=0; i<num_threads; i++) {
+		pthread_mutex_init(&tpool->queues[i].lock, 0);
+	}
+	pthread_mutex_init(&tpool->idle_lock, 0);
+	pthread_cond_init(&tpool->idle_cond, 0);
+
+	tpool->threads = new pthread_t[num_threads];
+	for(int i=0; i<num_threads - 1; i++) {
+		WorkerInfo *wi = new WorkerInfo;
+		wi->tpool = tpool;
+		wi->idx = i;
+
+		if(pthread_create(tpool->threads + i, 0, worker_func, wi) != 0) {
+			fprintf(stderr, "failed to create worker thread, continuing with %d threads\n", i + 1);
+			delete wi;
+
+			// the caller's queue has to be the last one
+			tpool->num_threads = i + 1;
+			break;
+		}
+	}
+	return tpool;
+}
+
+void tpool_destroy(ThreadPool *tpool)
+{
+	if(!tpool) return;
+
+	pthread_mutex_lock(&tpool->idle_lock);
+	tpool->quit = true;
+	pthread_cond_broadcast(&tpool->idle_cond);
+	pthread_mutex_unlock(&tpool->idle_lock);
+
+	for(int i=0; i<tpool->num_threads - 1; i++) {
+		pthread_join(tpool->threads[i], 0);
+	}
+
+	for(int i=0; i<tpool->num_threads; i++) {
+		pthread_mutex_destroy(&tpool->queues[i].lock);
+	}
+	delete [] tpool->queues;
+	delete [] tpool->threads;
+	pthread_mutex_destroy(&tpool->idle_lock);
+	pthread_cond_destroy(&tpool->idle_cond);
+	delete tpool;
+}
+
+int tpool_num_threads(const ThreadPool *tpool)
+{
+	return tpool ? tpool->num_threads : 1;
+}
+
+int tpool_num_processors()
+{
+	long num = sysconf(_SC_NPROCESSORS_ONLN);
+	return num > 0 ? (int)num : 1;
+}
+
+int tpool_thread_index(const ThreadPool *tpool)
+{
+	return tpool ? cur_queue(tpool) : 0;
+}
+
+void tpool_spawn(ThreadPool *tpool, TaskGroup *grp, TaskFunc func, void *cls)
+{
+	if(!tpool || tpool->num_threads <= 1) {
+		func(cls);
+		return;
+	}
+
+	Task task;
+	task.func = func;
+	task.cls = cls;
+	task.grp = grp;
+
+	__atomic_fetch_add(&grp->pending, 1, __ATOMIC_ACQ_REL);
+
+	TaskQueue *q = tpool->queues + cur_queue(tpool);
+	pthread_mutex_lock(&q->lock);
+	q->tasks.push_back(task);
+	pthread_mutex_unlock(&q->lock);
+
+	__atomic_fetch_add(&tpool->num_queued, 1, __ATOMIC_ACQ_REL);
+
+	pthread_mutex_lock(&tpool->idle_lock);
+	pthread_cond_signal(&tpool->idle_cond);
+	pthread_mutex_unlock(&tpool->idle_lock);
+}
+
+void tpool_wait(ThreadPool *tpool, TaskGroup *grp)
+{
+	if(!tpool || tpool->num_threads <= 1) {
+		return;
+	}
+
+	int self = cur_queue(tpool);
+
+	while(__atomic_load_n(&grp->pending, __ATOMIC_ACQUIRE) > 0) {
+		Task task;
+		if(get_task(tpool, self, &task)) {
+			run_task(task);
+		} else {
+			sched_yield();	// the remaining tasks are running on other threads
+		}
+	}
+}
+
+static void *worker_func(void *arg)
+{
+	WorkerInfo *wi = (WorkerInfo*)arg;
+	ThreadPool *tpool = wi->tpool;
+	int self = wi->idx;
+	delete wi;
+
+	pthread_setspecific(worker_key, (void*)(tpool->queues + self));
+
+	for(;;) {
+		Task task;
+		if(get_task(tpool, self, &task)) {
+			run_task(task);
+			continue;
+		}
+
+		pthread_mutex_lock(&tpool->idle_lock);
+		while(!__atomic_load_n(&tpool->num_queued, __ATOMIC_ACQUIRE) && !tpool->quit) {
+			pthread_cond_wait(&tpool->idle_cond, &tpool->idle_lock);
+		}
+		bool quit = tpool->quit;
+		pthread_mutex_unlock(&tpool->idle_lock);
+
+		if(quit) break;
+	}
+	return 0;
+}
+
+// index of the queue owned by the calling thread, non-workers share the last one
+static int cur_queue(const ThreadPool *tpool)
+{
+	TaskQueue *q = (TaskQueue*)pthread_getspecific(worker_key);
+	if(q >= tpool->queues && q < tpool->queues + tpool->num_threads) {
+		return q - tpool->queues;
+	}
+	return tpool->num_threads - 1;
+}
+
+static bool get_task(ThreadPool *tpool, int self, Task *task)
+{
+	if(!__atomic_load_n(&tpool->num_queued, __ATOMIC_ACQUIRE)) {
+		return false;
+	}
+
+	// newest task from our own queue first ...
+	TaskQueue *q = tpool->queues + self;
+	pthread_mutex_lock(&q->lock);
+	if(!q->tasks.empty()) {
+		*task = q->tasks.back();
+		q->tasks.pop_back();
+		pthread_mutex_unlock(&q->lock);
+		__atomic_fetch_sub(&tpool->num_queued, 1, __ATOMIC_ACQ_REL);
+		return true;
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	// ... otherwise steal the oldest (and usually biggest) task of another thread
+	for(int i=1; i<tpool->num_threads; i++) {
+		q = tpool->queues + (self + i) % tpool->num_threads;
+
+		pthread_mutex_lock(&q->lock);
+		if(!q->tasks.empty()) {
+			*task = q->tasks.front();
+			q->tasks.pop_front();
+			pthread_mutex_unlock(&q->lock);
+			__atomic_fetch_sub(&tpool->num_queued, 1, __ATOMIC_ACQ_REL);
+			return true;
+		}
+		pthread_mutex_unlock(&q->lock);
+	}
+	return false;
+}
+
+static void run_task(const Task &task)
+{
+	task.func(task.cls);
+	__atomic_fetch_sub(&task.grp->pending, 1, __ATOMIC_ACQ_REL);
+}
+
+#else	/* no pthreads, run everything on the calling thread */
+
+struct ThreadPool {
+	int num_threads;
+};
+
+ThreadPool *tpool_create(int num_threads)
+{
+	ThreadPool *tpool = new ThreadPool;
+	tpool->num_threads = 1;
+	return tpool;
+}
+
+void tpool_destroy(ThreadPool *tpool)
+{
+	delete tpool;
+}
+
+int tpool_num_threads(const ThreadPool *tpool)
+{
+	return 1;
+}
+
+int tpool_num_processors()
+{
+	return 1;
+}
+
+int tpool_thread_index(const ThreadPool *tpool)
+{
+	return 0;
+}
+
+void tpool_spawn(ThreadPool *tpool, TaskGroup *grp, TaskFunc func, void *cls)
+{
+	func(cls);
+}
+
+void tpool_wait(ThreadPool *tpool, TaskGroup *grp)
+{
+}
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef TPOOL_H_
+#define TPOOL_H_
+
+/* Fork-join thread pool with work-stealing.
+ * Every thread has its own task queue. Spawned tasks are pushed on the
+ * spawning thread's queue and popped LIFO by their owner, while idle threads
+ * steal from the other end of someone else's queue. Threads blocked in
+ * tpool_wait keep executing tasks, so tasks may spawn and wait recursively.
+ *
+ * Without pthreads, or with a single thread, tasks just run synchronously
+ * from tpool_spawn.
+ */
+
+struct ThreadPool;
+
+struct TaskGroup {
+	volatile int pending;
+
+	TaskGroup();
+};
+
+typedef void (*TaskFunc)(void *cls);
+
+// num_threads includes the calling thread, 0 means one per processor
+ThreadPool *tpool_create(int num_threads = 0);
+void tpool_destroy(ThreadPool *tpool);
+
+int tpool_num_threads(const ThreadPool *tpool);
+int tpool_num_processors();
+/* index of the calling thread in [0, num_threads), for per-thread data.
+ * Threads outside the pool get the index of the thread which created it.
+ */
+int tpool_thread_index(const ThreadPool *tpool);
+
+void tpool_spawn(ThreadPool *tpool, TaskGroup *grp, TaskFunc func, void *cls);
+// waits for all the tasks of the group, running queued tasks in the meantime
+void tpool_wait(ThreadPool *tpool, TaskGroup *grp);
+
+#endif	/* TPOOL_H_ */